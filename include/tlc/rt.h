@@ -1,7 +1,14 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
-#include <unordered_set>
 #include <vector>
 
 namespace tlc {
@@ -18,11 +25,36 @@ enum class ValueType : std::uint8_t {
     memory_handle,
 };
 
+// Outcome of the non-throwing variants of the hot operations. These only set a status that is still ok, i.e.
+// it is sticky and keeps the first error, such that a batch of operations can be checked at once.
+enum class Status : std::uint8_t {
+    ok,
+    incompatible_types,
+    handle_operand,
+    invalid_handle,
+    invalid_index,
+    empty_pop,
+};
+
+const char* statusMessage(Status status);
+
+struct Value;
+
+// records the error unless an earlier one is recorded already, failed operations return integer 0
+inline Value failWith(Status& status, Status error);
+
 struct Value {
+#ifdef COMPACT_VALUES
+    // integers and handles share a single tagged 64-bit word: the type tag lives in the low bit
+    // and the payload in the upper 63 bits, so integers are 63-bit and wrap around on overflow
+    ValueType type : 1;
+    i64 data : 63;
+#else
     i64 data;
     ValueType type;
+#endif
 
-    Value(i64 data, ValueType type);
+    inline Value(i64 data, ValueType type);
     Value() = default;
 
     Value toInteger() const;
@@ -44,49 +76,615 @@ struct Value {
     Value operator==(const Value& other) const;
     Value operator!=(const Value& other) const;
     Value operator^(const Value& other) const;
+
+    // non-throwing variants of the operators above, in the same order
+    Value add(const Value& other, Status& status) const;
+    Value sub(const Value& other, Status& status) const;
+    Value mul(const Value& other, Status& status) const;
+    Value div(const Value& other, Status& status) const;
+    Value mod(const Value& other, Status& status) const;
+    Value bitAnd(const Value& other, Status& status) const;
+    Value bitOr(const Value& other, Status& status) const;
+    Value logicalAnd(const Value& other, Status& status) const;
+    Value logicalOr(const Value& other, Status& status) const;
+    Value logicalNot(Status& status) const;
+    Value bitNot(Status& status) const;
+    Value lt(const Value& other, Status& status) const;
+    Value gt(const Value& other, Status& status) const;
+    Value le(const Value& other, Status& status) const;
+    Value ge(const Value& other, Status& status) const;
+    Value eq(const Value& other, Status& status) const;
+    Value ne(const Value& other, Status& status) const;
+    Value bitXor(const Value& other, Status& status) const;
+
+    // error paths of the (inline) operators
+    [[noreturn]] static void throwIncompatibleTypes();
+    [[noreturn]] static void throwHandleOperand(const char* op);
+};
+
+#ifdef COMPACT_VALUES
+static_assert(sizeof(Value) == sizeof(i64), "compact values must fit into a single 64-bit word");
+#endif
+
+// The operators are defined inline such that arithmetic in callers compiles down to a type check and the
+// operation itself, only the error paths are out-of-line.
+#ifdef COMPACT_VALUES
+inline Value::Value(i64 data, ValueType type)
+    : type(type), data(data) {}
+
+namespace detail {
+// An integer's tagged word is its value shifted left by one with a zero tag bit. Thus, the tag bit of
+// (a | b) is clear iff both operands are integers and +, -, &, | and ^ can operate directly on the
+// tagged words without untagging them first.
+inline std::uint64_t toWord(const Value& value) {
+    std::uint64_t word;
+    std::memcpy(&word, &value, sizeof(word));
+    return word;
+}
+
+inline Value fromWord(std::uint64_t word) {
+    Value value;
+    std::memcpy(&value, &word, sizeof(value));
+    return value;
+}
+} // namespace detail
+#else
+inline Value::Value(i64 data, ValueType type)
+    : data(data), type(type) {}
+#endif
+
+inline Value Value::toInteger() const {
+    return Value(data, ValueType::integer);
+}
+
+inline Value failWith(Status& status, Status error) {
+    if (status == Status::ok)
+        status = error;
+    return Value(0, ValueType::integer);
+}
+
+#define TLC_RT_DEFINE_BINARY_OPERATOR(sign, name) \
+inline Value Value::operator sign(const Value& other) const { \
+    if (type != ValueType::integer || other.type != ValueType::integer) \
+        throwIncompatibleTypes(); \
+    return Value(data sign other.data, ValueType::integer); \
+} \
+inline Value Value::name(const Value& other, Status& status) const { \
+    if (type != ValueType::integer || other.type != ValueType::integer) \
+        return failWith(status, Status::incompatible_types); \
+    return Value(data sign other.data, ValueType::integer); \
+}
+
+#ifdef COMPACT_VALUES
+#define TLC_RT_DEFINE_WORD_OPERATOR(sign, name) \
+inline Value Value::operator sign(const Value& other) const { \
+    std::uint64_t a = detail::toWord(*this), b = detail::toWord(other); \
+    if ((a | b) & 1) \
+        throwIncompatibleTypes(); \
+    return detail::fromWord(a sign b); \
+} \
+inline Value Value::name(const Value& other, Status& status) const { \
+    std::uint64_t a = detail::toWord(*this), b = detail::toWord(other); \
+    if ((a | b) & 1) \
+        return failWith(status, Status::incompatible_types); \
+    return detail::fromWord(a sign b); \
+}
+#else
+#define TLC_RT_DEFINE_WORD_OPERATOR(sign, name) TLC_RT_DEFINE_BINARY_OPERATOR(sign, name)
+#endif
+
+TLC_RT_DEFINE_WORD_OPERATOR(+, add)
+TLC_RT_DEFINE_WORD_OPERATOR(-, sub)
+TLC_RT_DEFINE_BINARY_OPERATOR(*, mul)
+TLC_RT_DEFINE_BINARY_OPERATOR(/, div)
+TLC_RT_DEFINE_BINARY_OPERATOR(%, mod)
+TLC_RT_DEFINE_WORD_OPERATOR(&, bitAnd)
+TLC_RT_DEFINE_WORD_OPERATOR(|, bitOr)
+TLC_RT_DEFINE_BINARY_OPERATOR(&&, logicalAnd)
+TLC_RT_DEFINE_BINARY_OPERATOR(||, logicalOr)
+TLC_RT_DEFINE_BINARY_OPERATOR(<, lt)
+TLC_RT_DEFINE_BINARY_OPERATOR(>, gt)
+TLC_RT_DEFINE_BINARY_OPERATOR(<=, le)
+TLC_RT_DEFINE_BINARY_OPERATOR(>=, ge)
+TLC_RT_DEFINE_BINARY_OPERATOR(==, eq)
+TLC_RT_DEFINE_BINARY_OPERATOR(!=, ne)
+TLC_RT_DEFINE_WORD_OPERATOR(^, bitXor)
+
+#undef TLC_RT_DEFINE_WORD_OPERATOR
+#undef TLC_RT_DEFINE_BINARY_OPERATOR
+
+inline Value Value::operator!() const {
+    if (type != ValueType::integer)
+        throwHandleOperand("!");
+    return Value(!data, type);
+}
+
+inline Value Value::operator~() const {
+    if (type != ValueType::integer)
+        throwHandleOperand("~");
+    return Value(~data, type);
+}
+
+inline Value Value::logicalNot(Status& status) const {
+    if (type != ValueType::integer)
+        return failWith(status, Status::handle_operand);
+    return Value(!data, type);
+}
+
+inline Value Value::bitNot(Status& status) const {
+    if (type != ValueType::integer)
+        return failWith(status, Status::handle_operand);
+    return Value(~data, type);
+}
+
+// Per-context allocator for array payloads. Blocks are segregated into power-of-two size classes that are
+// carved out of large chunks (mapped from the OS) and recycled through free lists, such that allocating is a free list pop and
+// freeing is a push. Blocks of the largest class and beyond come from the global operator new.
+class PayloadArena {
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    // FreeBlock is stored in the freed block itself
+    static_assert(sizeof(Value) >= sizeof(FreeBlock*), "a free block must fit into a single value");
+    static constexpr std::size_t n_size_classes = 13;
+    static constexpr std::size_t chunk_size = std::size_t(1) << 18;
+
+    FreeBlock* m_free_lists[n_size_classes]{};
+    char* m_chunk_cursor{nullptr};
+    char* m_chunk_end{nullptr};
+    std::vector<void*> m_chunks;
+    // chunks detached by beginCompaction, freed by endCompaction once no payload lives in them anymore
+    std::vector<void*> m_old_chunks;
+
+    // nursery for the payloads of young handles: allocating is a bump of the cursor and freeing is a no-op,
+    // the whole nursery is reclaimed at once by youngGC after it evacuated the surviving payloads
+    static constexpr std::size_t nursery_size = std::size_t(1) << 20;
+    char* m_nursery{nullptr};
+    char* m_nursery_cursor{nullptr};
+    char* m_nursery_end{nullptr};
+
+    // class c holds blocks of 2^c values
+    static std::size_t sizeClass(std::size_t n) {
+        std::size_t c = 0;
+        while ((std::size_t(1) << c) < n)
+            c++;
+        return c;
+    }
+
+    Value* carve(std::size_t size_class);
+    Value* allocateYoungSlow(std::size_t n);
+
+public:
+    // the largest number of values a block may hold, such that its size in bytes fits a ptrdiff_t
+    static constexpr std::size_t max_values = PTRDIFF_MAX / sizeof(Value);
+
+    PayloadArena() = default;
+    PayloadArena(const PayloadArena&) = delete;
+    PayloadArena& operator=(const PayloadArena&) = delete;
+    ~PayloadArena();
+
+    // the number of values a block allocated for n values can hold
+    static std::size_t capacityFor(std::size_t n) {
+        std::size_t c = sizeClass(n);
+        return c < n_size_classes ? std::size_t(1) << c : n;
+    }
+
+    Value* allocate(std::size_t n) {
+        std::size_t c = sizeClass(n);
+        if (c >= n_size_classes) {
+            if (n > max_values)
+                throw std::bad_alloc();
+            return static_cast<Value*>(::operator new(n * sizeof(Value)));
+        }
+        if (FreeBlock* block = m_free_lists[c]) {
+            m_free_lists[c] = block->next;
+            return reinterpret_cast<Value*>(block);
+        }
+        return carve(c);
+    }
+
+    // n must be a capacity returned by capacityFor, such that evacuated payloads fit the same size class
+    Value* allocateYoung(std::size_t n) {
+        if (static_cast<std::size_t>(m_nursery_end - m_nursery_cursor) / sizeof(Value) < n)
+            return allocateYoungSlow(n);
+        Value* block = reinterpret_cast<Value*>(m_nursery_cursor);
+        m_nursery_cursor += n * sizeof(Value);
+        return block;
+    }
+
+    // whether a block of the given capacity is carved from the chunks (and thus moved by compaction)
+    static bool isChunked(std::size_t capacity) {
+        return sizeClass(capacity) < n_size_classes;
+    }
+
+    bool inNursery(const Value* p) const {
+        const char* c = reinterpret_cast<const char*>(p);
+        return c >= m_nursery && c < m_nursery_end;
+    }
+
+    // only valid once no payload lives in the nursery anymore
+    void resetNursery() {
+        m_nursery_cursor = m_nursery;
+    }
+
+    void beginCompaction();
+    void endCompaction();
+
+    void deallocate(Value* p, std::size_t n) {
+        if (inNursery(p))
+            return;
+        std::size_t c = sizeClass(n);
+        if (c >= n_size_classes) {
+            ::operator delete(p);
+            return;
+        }
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(p);
+        block->next = m_free_lists[c];
+        m_free_lists[c] = block;
+    }
+};
+
+// Storage of an array. Most arrays are small tuples and records, so arrays of up to inline_capacity values are
+// stored inline and only larger ones spill to a block of the context's PayloadArena. The payload does not
+// store a pointer to the arena, so operations that may allocate or free take it as an argument.
+class Payload {
+public:
+    static constexpr std::size_t inline_capacity = 4;
+
+private:
+    union {
+        Value m_inline[inline_capacity];
+        Value* m_heap;
+    };
+    std::size_t m_size{0};
+    std::size_t m_capacity{inline_capacity};
+
+    void grow(std::size_t min_capacity, PayloadArena& arena, bool young);
+
+public:
+    Payload() {}
+    Payload(const Payload&) = delete;
+    Payload& operator=(const Payload&) = delete;
+
+    Payload(Payload&& other) noexcept
+        : m_size(other.m_size), m_capacity(other.m_capacity) {
+        if (other.isInline()) {
+            std::copy(other.m_inline, other.m_inline + other.m_size, m_inline);
+        } else {
+            m_heap = other.m_heap;
+            other.m_capacity = inline_capacity;
+        }
+        other.m_size = 0;
+    }
+
+    // spilled payloads always hold more than inline_capacity values
+    bool isInline() const {
+        return m_capacity == inline_capacity;
+    }
+
+    // memory held outside of the handle, i.e. the size of the spilled block
+    std::size_t bytes() const {
+        return isInline() ? 0 : m_capacity * sizeof(Value);
+    }
+
+    Value* begin() {
+        return isInline() ? m_inline : m_heap;
+    }
+
+    const Value* begin() const {
+        return isInline() ? m_inline : m_heap;
+    }
+
+    Value* end() {
+        return begin() + m_size;
+    }
+
+    const Value* end() const {
+        return begin() + m_size;
+    }
+
+    std::size_t size() const {
+        return m_size;
+    }
+
+    bool empty() const {
+        return m_size == 0;
+    }
+
+    Value& operator[](std::size_t i) {
+        return begin()[i];
+    }
+
+    const Value& operator[](std::size_t i) const {
+        return begin()[i];
+    }
+
+    Value& back() {
+        return begin()[m_size - 1];
+    }
+
+    // payloads of young handles spill to the nursery of the arena
+    void push_back(Value value, PayloadArena& arena, bool young = false) {
+        if (m_size == m_capacity)
+            grow(m_size + 1, arena, young);
+        begin()[m_size++] = value;
+    }
+
+    void pop_back() {
+        m_size--;
+    }
+
+    // new entries are zero-initialized
+    void resize(std::size_t n, PayloadArena& arena, bool young = false) {
+        if (n > m_capacity)
+            grow(n, arena, young);
+        if (n > m_size)
+            std::fill(begin() + m_size, begin() + n, Value{});
+        m_size = n;
+    }
+
+    // moves a payload out of the nursery, which is required before the nursery is reset
+    void evacuate(PayloadArena& arena) {
+        if (isInline() || !arena.inNursery(m_heap))
+            return;
+        Value* block = arena.allocate(m_capacity);
+        std::copy(begin(), end(), block);
+        m_heap = block;
+    }
+
+    // copies a payload that was carved from the chunks to a fresh block, the old block is freed along with its chunk
+    void relocate(PayloadArena& arena) {
+        if (isInline() || arena.inNursery(m_heap) || !PayloadArena::isChunked(m_capacity))
+            return;
+        Value* block = arena.allocate(m_capacity);
+        std::copy(begin(), end(), block);
+        m_heap = block;
+    }
+
+    // frees the spilled block (if any), leaving an empty payload
+    void release(PayloadArena& arena) {
+        if (!isInline())
+            arena.deallocate(m_heap, m_capacity);
+        m_size = 0;
+        m_capacity = inline_capacity;
+    }
 };
 
 struct MemoryHandle {
-    std::vector<Value> data;
+    Payload data;
+    // the id under which this handle is referenced by values, 0 if the slot is free
     i64 alloc_id;
     i32 ref_count;
-    // List of all flags:
-    // -> flags & 1 -> marked reachable by major GC
+    // List of all flags (major GC marks are kept in a side bitmap of the Context):
+    // -> flags & 1 -> young, i.e. allocated in generational mode and not yet promoted by a youngGC
+    // -> flags & 2 -> remembered, i.e. an old handle that may reference young handles
+    // -> flags & 4 -> marked reachable by youngGC
+    // -> flags & 8 -> queued as a minorGC candidate
+    // -> flags & 16 -> buffered as a possible root of a garbage cycle
+    // -> flags & 32, flags & 64 -> gray, white (transient colors of the cycle collector)
+    // -> flags & 128 -> payload already moved by the current compaction
     i32 flags{0};
+    // bumped whenever the slot is freed such that ids referring to previous occupants become invalid
+    i32 generation;
+
+    MemoryHandle(i64 alloc_id, i32 ref_count);
+};
+
+// work limit of a single GC slice: a number of steps (64 variable buckets shaded, array entries scanned, 64 slots
+// checked or a handle released by majorGC, or handles released by minorGC) and/or a deadline for all phases, which is polled every clock_check_interval
+// units of work
+struct GCBudget {
+    static constexpr i64 clock_check_interval = 256;
+    i64 steps;
+    bool timed{false};
+    std::chrono::steady_clock::time_point deadline;
+    i64 clock_countdown{clock_check_interval};
 
-    MemoryHandle(std::vector<Value> data, i64 alloc_id, i32 ref_count);
+    explicit GCBudget(i64 max_steps);
+    explicit GCBudget(std::chrono::nanoseconds duration);
+    inline bool tick();
+    inline bool step();
 };
 
-// WARNING: not thread safe
-class Context {
-    i64 m_alloc_counter{1};
-    std::unordered_map<VarT, Value> m_data;
+// reports a violated precondition of an unchecked access and aborts
+[[noreturn]] void uncheckedAccessViolation(const char* condition);
+
+#ifdef ASSERT_UNCHECKED_ACCESS
+#define TLC_RT_ASSERT_TRUSTED(condition) ((condition) ? void(0) : ::tlc::rt::uncheckedAccessViolation(#condition))
+#else
+#define TLC_RT_ASSERT_TRUSTED(condition) void(0)
+#endif
+
+// Memory management policies a context can be instantiated with. All of them trace (majorGC), they differ in
+// which references are counted for the minorGC. Every policy is compiled into the library.
+// -> minorGC counts references held by arrays and variables
+struct RefCountingGC {
+    static constexpr bool counts_references = true;
+    static constexpr bool counts_root_references = true;
+};
+// -> minorGC counts references held by arrays, variables are scanned by minorGC instead (deferred reference counting)
+struct DeferredRefCountingGC {
+    static constexpr bool counts_references = true;
+    static constexpr bool counts_root_references = false;
+};
+// -> no reference counting, minorGC and collectCycles do nothing
+struct TracingGC {
+    static constexpr bool counts_references = false;
+    static constexpr bool counts_root_references = false;
+};
+
+// WARNING: not thread safe (except for the internal marker thread of concurrent major GC cycles)
+template <typename Policy>
+class BasicContext {
+    // states of m_magc_state
+    static constexpr i8 magc_idle = 0;
+    static constexpr i8 magc_incremental = 1;
+    static constexpr i8 magc_concurrent = 2;
+
+    // phases of a major GC cycle (m_magc_phase), sweeping happens lazily after the cycle
+    static constexpr i8 magc_scanning_roots = 0;
+    static constexpr i8 magc_marking = 1;
+
+    // MemoryHandle::flags
+    static constexpr i32 flag_young = 0x1;
+    static constexpr i32 flag_remembered = 0x2;
+    static constexpr i32 flag_young_marked = 0x4;
+    static constexpr i32 flag_queued = 0x8;
+    static constexpr i32 flag_buffered = 0x10;
+    static constexpr i32 flag_gray = 0x20;
+    static constexpr i32 flag_white = 0x40;
+    static constexpr i32 flag_relocated = 0x80;
+
+    struct Variable {
+        Value value;
+    };
+    // deferred reference counting: logged is set once the value the variable held at the last collection is in
+    // m_root_log, so every variable is logged at most once between two collections
+    struct LoggedVariable {
+        Value value;
+        bool logged{false};
+    };
+    using VariableSlot = std::conditional_t<Policy::counts_references && !Policy::counts_root_references,
+                                            LoggedVariable, Variable>;
+
+    std::unordered_map<VarT, VariableSlot> m_data;
     std::unordered_map<FunT, void*> m_functions;
-    std::unordered_map<i64, MemoryHandle> m_mem_handles;
+    // must outlive m_mem_handles, whose payloads it holds
+    PayloadArena m_payload_arena;
+    // dense handle table indexed by the slot encoded in memory handle ids
+    std::vector<MemoryHandle> m_mem_handles;
+    // slots of freed handles, reused in LIFO order so recently freed (cache-warm) slots are handed out first
+    std::vector<i64> m_free_slots;
     std::vector<i64> m_gc_candidates;
+    // deferred reference counting: the value each variable assigned or erased since the last collection held then
+    std::vector<std::pair<VarT, Value>> m_root_log;
+    // cycle collector: handles that lost a reference but are still referenced, plus scratch worklists
+    std::vector<i64> m_cycle_roots;
+    // once m_cycle_roots reaches this size, entries that can no longer be roots are dropped, which keeps it bounded
+    // by (twice) the number of live handles even if collectCycles is never called
+    std::size_t m_cycle_roots_limit{1024};
+    std::vector<i64> m_cycle_stack;
+    std::vector<i64> m_cycle_tmp_stack;
+    std::vector<i64> m_cycle_tmp_garbage_allocs;
 
     // reuse heap allocated variables of majorGC
-    std::unordered_set<i64> m_magc_visited_mem_handles;
-    std::unordered_set<i64> m_magc_new_mem_handles;
-    std::unordered_set<i64> m_magc_next_mem_handles;
-    std::vector<i64> m_magc_tmp_garbage_allocs;
-    std::vector<i64> m_migc_tmp_garbage_allocs;
-    std::vector<i64> m_release_tmp_valid_garbage_allocs;
+    // one mark bit per handle slot, kept sized to m_mem_handles. A slot is marked if its bit equals the
+    // polarity, which flips with every cycle such that marks never have to be cleared.
+    std::vector<std::uint64_t> m_magc_mark_bits;
+    bool m_magc_mark_polarity{false};
+    // gray worklist: ids of handles that are marked but whose entries have not been scanned yet, persists
+    // across the slices of incremental and concurrent cycles
+    std::vector<i64> m_magc_mark_stack;
+    std::vector<i64> m_ygc_tmp_garbage_allocs;
 
     // state tracking for majorGC work limit feature
+    // -> id of the handle whose scan was interrupted (0 if none) and the entry to resume at
     i64 m_magc_last_handle{0};
     i64 m_magc_last_handle_entry{0};
+    // -> 0 if no cycle is in progress, 1 for incremental cycles, 2 for concurrent cycles
     i8 m_magc_state{0};
-    
+    // -> 0 while scanning roots, 1 while marking
+    i8 m_magc_phase{0};
+    // -> next bucket of m_data to scan and the bucket count when root scanning began
+    i64 m_magc_root_bucket{0};
+    i64 m_magc_root_buckets{0};
+
+    // garbage of the last cycle is released lazily, slots from m_sweep_cursor onwards are not swept yet
+    bool m_sweep_pending{false};
+    i64 m_sweep_cursor{0};
+
+    // generational mode: ids of young handles (possibly stale) and of remembered old handles
+    bool m_generational{false};
+    std::vector<i64> m_young_handles;
+    std::vector<i64> m_remembered_handles;
+    std::vector<i64> m_ygc_mark_stack;
+
+    // number of work-stealing workers marking during a full majorGC, 0 marks sequentially on the calling thread
+    i64 m_magc_threads{0};
+
+    // heap accounting: bytes of live handles and their payloads, and of all allocations ever made
+    std::size_t m_live_bytes{0};
+    std::size_t m_allocated_bytes{0};
+    // pacer: once the live bytes reach the trigger, every allocated byte adds to the debt, which safepoint pays
+    // off by running incremental majorGC slices whenever it exceeds pacer_quantum (disabled while the heap budget
+    // is 0)
+    static constexpr std::size_t pacer_quantum = std::size_t(1) << 16;
+    std::size_t m_heap_budget{0};
+    double m_heap_growth_factor{2.0};
+    std::size_t m_gc_trigger{0};
+    std::size_t m_gc_debt{0};
+
+    // full majorGC invocations compact the payloads of the survivors if enabled
+    bool m_compacting{false};
+    std::vector<i64> m_compact_stack;
+
+    // state of concurrent major GC cycles, the marker thread only touches the heap while holding the mutex
+    std::thread m_cgc_thread;
+    std::mutex m_cgc_mutex;
+    std::atomic<bool> m_cgc_marked{false};
+    std::atomic<bool> m_cgc_abort{false};
+
+    // the slot of a handle is stored in the lower 32 bits of its id
+    static std::uint32_t allocIdSlot(i64 alloc_id) {
+        return static_cast<std::uint32_t>(alloc_id);
+    }
+    [[noreturn]] static void throwInvalidHandle();
+    [[noreturn]] static void throwInvalidIndex(std::size_t size);
+    [[noreturn]] static void throwEmptyPop();
+    inline MemoryHandle* findMemHandle(const Value& value);
+
     inline void incref(const Value& data);
     inline void decref(const Value& data);
-    inline void assertValidMemHandle(const Value& data);
+    inline void decref(MemoryHandle& mh);
+    inline void queueCandidate(MemoryHandle& mh);
+    inline void bufferCycleRoot(MemoryHandle& mh);
+    void pruneCycleRoots();
+    inline MemoryHandle* findMemHandle(i64 alloc_id);
+    inline MemoryHandle& derefMemHandle(const Value& data);
     void decoupleMemHandle(const MemoryHandle& mh);
-    void destroyMemHandle(const MemoryHandle& mh);
+    void destroyMemHandle(MemoryHandle& mh);
     void releaseGarbage(const std::vector<i64>& garbage_allocs);
+    void sweepEarly(i64 alloc_id);
+    inline bool isMarked(i64 slot) const;
+    inline void markSlot(i64 slot);
+    void shade(const Value& value);
+    inline void writeBarrier(const Value& value);
+    inline bool magcMarking() const;
+    inline void generationalBarrier(MemoryHandle& mh, const Value& value);
+    void rememberIfYoung(MemoryHandle& mh, const Value& value);
+    inline void shadeYoung(const Value& value);
+    inline bool isUnsweptGarbage(i64 slot) const;
+
+    bool minorGCSlice(GCBudget& budget);
+    bool releaseCandidates(GCBudget& budget);
+    void applyRootLog();
+    void cycleMarkGray(MemoryHandle& root);
+    void cycleScan(MemoryHandle& root);
+    void cycleScanBlack(MemoryHandle& root);
+    void cycleCollectWhite(MemoryHandle& root);
+    void flipMarks();
+    void beginMark();
+    void abandonCycle();
+    bool scanRootsSlice(GCBudget& budget);
+    bool markSlice(GCBudget& budget);
+    void beginSweep();
+    bool sweepNextSlot();
+    bool sweepSlice(GCBudget& budget);
+    void finishSweep();
+    bool majorGCSlice(GCBudget& budget);
+    void parallelMark();
+    void concurrentMark();
+    inline void relocatePayload(const Value& value);
+    inline void accountAllocation(std::size_t bytes, std::size_t replaced_bytes = 0);
+    inline void pushPayload(MemoryHandle& mh, Value value);
+    void updateGCTrigger();
+    void paceMajorGC();
+    inline std::unique_lock<std::mutex> lockHeap();
 
 public:
-    Context() = default;
+    BasicContext() = default;
+    ~BasicContext();
 
     void defineFunction(FunT id, void *fun);
     void eraseFunction(FunT id);
@@ -96,13 +694,411 @@ public:
     bool funIsDefined(FunT id);
 
     Value alloc(i64 size);
-    void push(Value array, Value value);
-    Value pop(Value array);
-    void write(Value array, i64 index, Value value);
-    Value read(Value array, i64 index);
+    // array accesses are inlined into callers (see below)
+    inline void push(Value array, Value value);
+    inline Value pop(Value array);
+    inline void write(Value array, i64 index, Value value);
+    inline Value read(Value array, i64 index);
+    // non-throwing variants of the array accesses, a failed access has no effect (see Status)
+    inline void push(Value array, Value value, Status& status);
+    inline Value pop(Value array, Status& status);
+    inline void write(Value array, i64 index, Value value, Status& status);
+    inline Value read(Value array, i64 index, Status& status);
+    // trusted variants of the array accesses for code that has proven the handles valid and the indices in
+    // bounds, they skip all validation (unless built with ASSERT_UNCHECKED_ACCESS, see BUILD.md)
+    inline void pushUnchecked(Value array, Value value);
+    inline Value popUnchecked(Value array);
+    inline void writeUnchecked(Value array, i64 index, Value value);
+    inline Value readUnchecked(Value array, i64 index);
 
-    void minorGC();
-    void majorGC(i64 max_steps = -1);
+    // returns whether all queued garbage was released, max_steps limits the number of handles released per call
+    // (the rest stays queued for the next call)
+    bool minorGC(i64 max_steps = -1);
+    // releases queued garbage for at most (roughly) the given duration
+    bool minorGC(std::chrono::nanoseconds budget);
+    // releases garbage cycles that minorGC cannot, by trial deletion of the arrays that lost references
+    void collectCycles();
+    // generational mode: handles start out young and youngGC collects only young handles, promoting survivors
+    void setGenerationalGC(bool enabled);
+    void youngGC();
+    // returns whether a cycle was finished, max_steps limits the work of the slice: variable buckets shaded and
+    // slots checked (64 per step each), array entries marked and handles released by the sweep of the last cycle
+    // (garbage becomes invalid immediately, but is released lazily by alloc, sweepGC and later cycles)
+    bool majorGC(i64 max_steps = -1);
+    // advances the current cycle through all of its phases for at most (roughly) the given duration
+    bool majorGC(std::chrono::nanoseconds budget);
+    // releases up to max_slots slots worth of garbage left by the last cycle, returns whether all of it is released
+    bool sweepGC(i64 max_slots = -1);
+    // full majorGC invocations mark using this many work-stealing threads, or sequentially on the calling thread
+    // if it is 0 (the default)
+    void setMajorGCThreads(i64 n_threads);
+    // moves the payloads of all live arrays to fresh memory in traversal order (arrays reachable from each other
+    // end up next to each other) and frees the memory they were fragmented across, handle ids are unaffected
+    void compactGC();
+    // full majorGC invocations sweep eagerly and compact afterwards
+    void setCompactingGC(bool enabled);
+    // bytes held by live arrays (handles and spilled payloads), including garbage that is not released yet
+    std::size_t liveBytes() const;
+    // bytes allocated by arrays since the context was created
+    std::size_t allocatedBytes() const;
+    // safepoint runs incremental majorGC slices once the live bytes exceed the budget, or the growth factor times
+    // the live bytes after the last cycle if that is more (0 disables automatic collection, the default)
+    void setHeapBudget(std::size_t bytes);
+    void setHeapGrowthFactor(double factor);
+    // pays for the allocations since the last call with majorGC work if the heap budget calls for it. Arrays that
+    // are not reachable from a variable (e.g. temporaries of the interpreter) may be released, so call it where
+    // there are none, such as between statements. It is cheap if there is nothing to do.
+    inline void safepoint();
+    // begins a major GC cycle that marks on a background thread, heap accesses of the interpreter take turns with
+    // the slices of the marker thread (see BUILD.md)
+    void startConcurrentMajorGC();
+    // remarks and sweeps once background marking is done, returns false without waiting if wait is false and it is not
+    bool finishConcurrentMajorGC(bool wait = true);
 };
+
+extern template class BasicContext<RefCountingGC>;
+extern template class BasicContext<DeferredRefCountingGC>;
+extern template class BasicContext<TracingGC>;
+
+// the policy of Context is chosen by the build options (see BUILD.md), the others remain available by name
+#if defined(NO_MINOR_GC)
+using Context = BasicContext<TracingGC>;
+#elif defined(DEFERRED_RC)
+using Context = BasicContext<DeferredRefCountingGC>;
+#else
+using Context = BasicContext<RefCountingGC>;
+#endif
+
+// Array accesses and the bookkeeping they need are defined inline such that callers get them inlined into
+// their loops. Error paths and the rest of the GC are out-of-line in lib/rt.cpp.
+template <typename Policy>
+inline MemoryHandle* BasicContext<Policy>::findMemHandle(i64 alloc_id) {
+    std::uint32_t slot = allocIdSlot(alloc_id);
+    if (slot >= m_mem_handles.size())
+        return nullptr;
+    MemoryHandle& mh = m_mem_handles[slot];
+    if (mh.alloc_id != alloc_id || (m_sweep_pending && isUnsweptGarbage(slot)))
+        return nullptr;
+    return &mh;
+}
+
+template <typename Policy>
+inline MemoryHandle& BasicContext<Policy>::derefMemHandle(const Value& value) {
+    MemoryHandle* mh = findMemHandle(value);
+    if (!mh)
+        throwInvalidHandle();
+    return *mh;
+}
+
+// a slot is marked if its mark bit equals the polarity of the current cycle
+template <typename Policy>
+inline bool BasicContext<Policy>::isMarked(i64 slot) const {
+    return ((m_magc_mark_bits[slot / 64] >> (slot % 64)) & 1) == m_magc_mark_polarity;
+}
+
+// unmarked handles in slots the lazy sweep has not reached yet are dead, even though not released yet
+template <typename Policy>
+inline bool BasicContext<Policy>::isUnsweptGarbage(i64 slot) const {
+    return slot >= m_sweep_cursor && !isMarked(slot);
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::incref(const Value& mem_handle) {
+    derefMemHandle(mem_handle).ref_count++;
+}
+
+// a handle is queued at most once until minorGC looks at it, no matter how often its count drops to zero
+template <typename Policy>
+inline void BasicContext<Policy>::queueCandidate(MemoryHandle& mh) {
+    if (!(mh.flags & flag_queued)) {
+        mh.flags |= flag_queued;
+        m_gc_candidates.push_back(mh.alloc_id);
+    }
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::bufferCycleRoot(MemoryHandle& mh) {
+    if (!(mh.flags & flag_buffered)) {
+        if (m_cycle_roots.size() >= m_cycle_roots_limit)
+            pruneCycleRoots();
+        mh.flags |= flag_buffered;
+        m_cycle_roots.push_back(mh.alloc_id);
+    }
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::decref(const Value& mem_handle) {
+    decref(derefMemHandle(mem_handle));
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::decref(MemoryHandle& mh) {
+    if (--mh.ref_count <= 0) {
+        queueCandidate(mh);
+    } else {
+        // a handle that lost a reference but is still referenced may be part of a garbage cycle
+        bufferCycleRoot(mh);
+    }
+}
+
+template <typename Policy>
+inline bool BasicContext<Policy>::magcMarking() const {
+    return m_magc_state != magc_idle;
+}
+
+// incremental update barrier: while a cycle is marking, every stored handle is shaded such that a
+// handle can never end up referenced only by already scanned arrays or variables while still unmarked
+template <typename Policy>
+inline void BasicContext<Policy>::writeBarrier(const Value& value) {
+    if (magcMarking())
+        shade(value);
+}
+
+// generational barrier: only old, not yet remembered arrays receiving handles need a closer look
+template <typename Policy>
+inline void BasicContext<Policy>::generationalBarrier(MemoryHandle& mh, const Value& value) {
+    if (m_generational && !(mh.flags & (flag_young | flag_remembered)) && value.type == ValueType::memory_handle)
+        rememberIfYoung(mh, value);
+}
+
+// while a concurrent cycle is running, changes to the heap must be serialized with the marker thread. read,
+// readUnchecked and erase skip the lock: the marker thread only writes the mark bits, the mark stack and its
+// position in the handle it scans (m_magc_*), never payloads, handles or m_data, which must stay that way.
+template <typename Policy>
+inline std::unique_lock<std::mutex> BasicContext<Policy>::lockHeap() {
+    if (m_magc_state == magc_concurrent)
+        return std::unique_lock<std::mutex>(m_cgc_mutex);
+    return std::unique_lock<std::mutex>();
+}
+
+// replaced_bytes were released for the allocation (e.g. the block of a payload that grew), they only count
+// against the live bytes
+template <typename Policy>
+inline void BasicContext<Policy>::accountAllocation(std::size_t bytes, std::size_t replaced_bytes) {
+    m_live_bytes += bytes - replaced_bytes;
+    m_allocated_bytes += bytes;
+    // a cycle is paid for until its sweep is done, even if the heap dropped below the trigger in the meantime
+    if (m_heap_budget && (m_live_bytes >= m_gc_trigger || m_magc_state != magc_idle || m_sweep_pending))
+        m_gc_debt += bytes;
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::safepoint() {
+    if (m_gc_debt >= pacer_quantum)
+        paceMajorGC();
+}
+
+/// append to the payload of a handle, accounting for the memory if it has to grow
+template <typename Policy>
+inline void BasicContext<Policy>::pushPayload(MemoryHandle& mh, Value value) {
+    std::size_t bytes = mh.data.bytes();
+    mh.data.push_back(value, m_payload_arena, mh.flags & flag_young);
+    if (mh.data.bytes() != bytes)
+        accountAllocation(mh.data.bytes(), bytes);
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::push(Value array, Value value) {
+    auto lock = lockHeap();
+    MemoryHandle& mh = derefMemHandle(array);
+    if constexpr (Policy::counts_references)
+        if (value.type == ValueType::memory_handle)
+            incref(value);
+    writeBarrier(value);
+    generationalBarrier(mh, value);
+    pushPayload(mh, value);
+}
+
+template <typename Policy>
+inline Value BasicContext<Policy>::pop(Value array) {
+    auto lock = lockHeap();
+    MemoryHandle& mh = derefMemHandle(array);
+    if (mh.data.size() == 0)
+        throwEmptyPop();
+    Value value = mh.data.back();
+    if constexpr (Policy::counts_references)
+        if (value.type == ValueType::memory_handle)
+            decref(value);
+    mh.data.pop_back();
+    return value;
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::write(Value array, i64 index, Value value) {
+    auto lock = lockHeap();
+    MemoryHandle& mh = derefMemHandle(array);
+    if (index < 0 || index >= mh.data.size())
+        throwInvalidIndex(mh.data.size());
+    if constexpr (Policy::counts_references) {
+        Value& current = mh.data[index];
+        if (current.type == ValueType::memory_handle)
+            decref(current);
+        if (value.type == ValueType::memory_handle)
+            incref(value);
+    }
+    writeBarrier(value);
+    generationalBarrier(mh, value);
+    mh.data[index] = value;
+}
+
+template <typename Policy>
+inline Value BasicContext<Policy>::read(Value array, i64 index) {
+    MemoryHandle& mh = derefMemHandle(array);
+    if (index < 0 || index >= mh.data.size())
+        throwInvalidIndex(mh.data.size());
+    return mh.data[index];
+}
+
+template <typename Policy>
+inline MemoryHandle* BasicContext<Policy>::findMemHandle(const Value& value) {
+    return value.type == ValueType::memory_handle ? findMemHandle(value.data) : nullptr;
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::push(Value array, Value value, Status& status) {
+    auto lock = lockHeap();
+    MemoryHandle* mh = findMemHandle(array);
+    if (!mh) {
+        failWith(status, Status::invalid_handle);
+        return;
+    }
+    if constexpr (Policy::counts_references) {
+        if (value.type == ValueType::memory_handle) {
+            MemoryHandle* target = findMemHandle(value.data);
+            if (!target) {
+                failWith(status, Status::invalid_handle);
+                return;
+            }
+            target->ref_count++;
+        }
+    }
+    writeBarrier(value);
+    generationalBarrier(*mh, value);
+    pushPayload(*mh, value);
+}
+
+template <typename Policy>
+inline Value BasicContext<Policy>::pop(Value array, Status& status) {
+    auto lock = lockHeap();
+    MemoryHandle* mh = findMemHandle(array);
+    if (!mh)
+        return failWith(status, Status::invalid_handle);
+    if (mh->data.size() == 0)
+        return failWith(status, Status::empty_pop);
+    Value value = mh->data.back();
+    if constexpr (Policy::counts_references) {
+        if (value.type == ValueType::memory_handle) {
+            MemoryHandle* target = findMemHandle(value.data);
+            if (!target)
+                return failWith(status, Status::invalid_handle);
+            decref(*target);
+        }
+    }
+    mh->data.pop_back();
+    return value;
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::write(Value array, i64 index, Value value, Status& status) {
+    auto lock = lockHeap();
+    MemoryHandle* mh = findMemHandle(array);
+    if (!mh) {
+        failWith(status, Status::invalid_handle);
+        return;
+    }
+    if (index < 0 || index >= mh->data.size()) {
+        failWith(status, Status::invalid_index);
+        return;
+    }
+    if constexpr (Policy::counts_references) {
+        MemoryHandle* target = nullptr;
+        if (value.type == ValueType::memory_handle && !(target = findMemHandle(value.data))) {
+            failWith(status, Status::invalid_handle);
+            return;
+        }
+        // the handle that is overwritten is looked up before any count changes, such that failing has no effect
+        const Value& current = mh->data[index];
+        MemoryHandle* overwritten = nullptr;
+        if (current.type == ValueType::memory_handle && !(overwritten = findMemHandle(current.data))) {
+            failWith(status, Status::invalid_handle);
+            return;
+        }
+        if (target)
+            target->ref_count++;
+        if (overwritten)
+            decref(*overwritten);
+    }
+    writeBarrier(value);
+    generationalBarrier(*mh, value);
+    mh->data[index] = value;
+}
+
+template <typename Policy>
+inline Value BasicContext<Policy>::read(Value array, i64 index, Status& status) {
+    MemoryHandle* mh = findMemHandle(array);
+    if (!mh)
+        return failWith(status, Status::invalid_handle);
+    if (index < 0 || index >= mh->data.size())
+        return failWith(status, Status::invalid_index);
+    return mh->data[index];
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::pushUnchecked(Value array, Value value) {
+    auto lock = lockHeap();
+    TLC_RT_ASSERT_TRUSTED(findMemHandle(array));
+    MemoryHandle& mh = m_mem_handles[allocIdSlot(array.data)];
+    if constexpr (Policy::counts_references) {
+        if (value.type == ValueType::memory_handle) {
+            TLC_RT_ASSERT_TRUSTED(findMemHandle(value));
+            m_mem_handles[allocIdSlot(value.data)].ref_count++;
+        }
+    }
+    writeBarrier(value);
+    generationalBarrier(mh, value);
+    pushPayload(mh, value);
+}
+
+template <typename Policy>
+inline Value BasicContext<Policy>::popUnchecked(Value array) {
+    auto lock = lockHeap();
+    TLC_RT_ASSERT_TRUSTED(findMemHandle(array));
+    MemoryHandle& mh = m_mem_handles[allocIdSlot(array.data)];
+    TLC_RT_ASSERT_TRUSTED(!mh.data.empty());
+    Value value = mh.data.back();
+    if constexpr (Policy::counts_references)
+        if (value.type == ValueType::memory_handle)
+            decref(m_mem_handles[allocIdSlot(value.data)]);
+    mh.data.pop_back();
+    return value;
+}
+
+template <typename Policy>
+inline void BasicContext<Policy>::writeUnchecked(Value array, i64 index, Value value) {
+    auto lock = lockHeap();
+    TLC_RT_ASSERT_TRUSTED(findMemHandle(array));
+    MemoryHandle& mh = m_mem_handles[allocIdSlot(array.data)];
+    TLC_RT_ASSERT_TRUSTED(index >= 0 && index < mh.data.size());
+    if constexpr (Policy::counts_references) {
+        Value& current = mh.data[index];
+        if (current.type == ValueType::memory_handle)
+            decref(m_mem_handles[allocIdSlot(current.data)]);
+        if (value.type == ValueType::memory_handle) {
+            TLC_RT_ASSERT_TRUSTED(findMemHandle(value));
+            m_mem_handles[allocIdSlot(value.data)].ref_count++;
+        }
+    }
+    writeBarrier(value);
+    generationalBarrier(mh, value);
+    mh.data[index] = value;
+}
+
+template <typename Policy>
+inline Value BasicContext<Policy>::readUnchecked(Value array, i64 index) {
+    TLC_RT_ASSERT_TRUSTED(findMemHandle(array));
+    const MemoryHandle& mh = m_mem_handles[allocIdSlot(array.data)];
+    TLC_RT_ASSERT_TRUSTED(index >= 0 && index < mh.data.size());
+    return mh.data[index];
+}
 } // namespace rt
 } // namespace tlc
@@ -0,0 +1,163 @@
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "tlc/rt.h"
+
+namespace tlc {
+namespace rt {
+namespace {
+// number of queued handles a worker keeps to itself before offering some of them to thieves
+constexpr std::size_t steal_batch_size = 64;
+
+struct alignas(64) MarkWorker {
+    // private stack of marked but unscanned handles, only touched by the owning worker. A deque, because batches
+    // are offered from its bottom
+    std::deque<i64> local;
+    // stealable work, the owner appends at the back and thieves take from the front
+    std::mutex mutex;
+    std::deque<i64> shared;
+    std::atomic<std::size_t> shared_size{0};
+};
+
+class ParallelMarker {
+    const std::vector<MemoryHandle>& m_mem_handles;
+    std::unique_ptr<std::atomic<std::uint64_t>[]> m_mark_bits;
+    std::vector<MarkWorker> m_workers;
+    std::atomic<i64> m_idle_workers{0};
+    std::size_t m_next_root_worker{0};
+
+    // mirrors Context::findMemHandle, the slot of a handle is stored in the lower 32 bits of its id
+    const MemoryHandle* findMemHandle(const Value& value) const {
+        if (value.type != ValueType::memory_handle)
+            return nullptr;
+        std::uint32_t slot = static_cast<std::uint32_t>(value.data);
+        if (slot >= m_mem_handles.size() || m_mem_handles[slot].alloc_id != value.data)
+            return nullptr;
+        return &m_mem_handles[slot];
+    }
+
+    /// sets the mark bit of a slot, returns whether it was previously unset
+    bool tryMark(std::uint32_t slot) {
+        std::uint64_t bit = std::uint64_t(1) << (slot % 64);
+        return !(m_mark_bits[slot / 64].fetch_or(bit, std::memory_order_relaxed) & bit);
+    }
+
+    void offerWork(MarkWorker& worker) {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        // hand out the oldest entries, which tend to root the largest unexplored subgraphs
+        auto begin = worker.local.begin(), end = begin + steal_batch_size;
+        worker.shared.insert(worker.shared.end(), begin, end);
+        worker.local.erase(begin, end);
+        worker.shared_size.store(worker.shared.size(), std::memory_order_release);
+    }
+
+    bool takeWork(MarkWorker& thief, MarkWorker& victim) {
+        if (victim.shared_size.load(std::memory_order_acquire) == 0)
+            return false;
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        std::size_t n = std::min(victim.shared.size(), steal_batch_size);
+        thief.local.insert(thief.local.end(), victim.shared.begin(), victim.shared.begin() + n);
+        victim.shared.erase(victim.shared.begin(), victim.shared.begin() + n);
+        victim.shared_size.store(victim.shared.size(), std::memory_order_release);
+        return n != 0;
+    }
+
+    bool steal(std::size_t self) {
+        for (std::size_t i = 0; i < m_workers.size(); i++)
+            if (takeWork(m_workers[self], m_workers[(self + i) % m_workers.size()]))
+                return true;
+        return false;
+    }
+
+    bool anySharedWork() const {
+        for (const MarkWorker& worker : m_workers)
+            if (worker.shared_size.load(std::memory_order_acquire) != 0)
+                return true;
+        return false;
+    }
+
+    void run(std::size_t self) {
+        MarkWorker& worker = m_workers[self];
+        while (true) {
+            while (!worker.local.empty()) {
+                i64 p = worker.local.back();
+                worker.local.pop_back();
+                for (const Value& v : m_mem_handles[static_cast<std::uint32_t>(p)].data)
+                    if (findMemHandle(v) && tryMark(static_cast<std::uint32_t>(v.data)))
+                        worker.local.push_back(v.data);
+                if (worker.local.size() >= 2 * steal_batch_size
+                    && worker.shared_size.load(std::memory_order_relaxed) == 0)
+                    offerWork(worker);
+            }
+            if (steal(self))
+                continue;
+
+            // termination: every worker is idle and there is no work left to steal
+            m_idle_workers.fetch_add(1, std::memory_order_acq_rel);
+            while (true) {
+                if (m_idle_workers.load(std::memory_order_acquire) == static_cast<i64>(m_workers.size())
+                    && !anySharedWork())
+                    return;
+                if (anySharedWork()) {
+                    m_idle_workers.fetch_sub(1, std::memory_order_acq_rel);
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+    }
+
+public:
+    ParallelMarker(const std::vector<MemoryHandle>& mem_handles, std::size_t n_words, i64 n_threads)
+        : m_mem_handles(mem_handles), m_mark_bits(new std::atomic<std::uint64_t>[n_words]()),
+          m_workers(n_threads) {}
+
+    void addRoot(const Value& value) {
+        if (findMemHandle(value) && tryMark(static_cast<std::uint32_t>(value.data))) {
+            // distribute the roots round-robin so every worker starts out with work
+            m_workers[m_next_root_worker].local.push_back(value.data);
+            m_next_root_worker = (m_next_root_worker + 1) % m_workers.size();
+        }
+    }
+
+    void markAll() {
+        std::vector<std::thread> threads;
+        for (std::size_t i = 1; i < m_workers.size(); i++)
+            threads.emplace_back([this, i]() { run(i); });
+        run(0);
+        for (std::thread& thread : threads)
+            thread.join();
+    }
+
+    std::uint64_t markWord(std::size_t i) const {
+        return m_mark_bits[i].load(std::memory_order_relaxed);
+    }
+};
+} // namespace
+
+/// mark all handles reachable from the roots using m_magc_threads work-stealing workers
+template <typename Policy>
+void BasicContext<Policy>::parallelMark() {
+    ParallelMarker marker(m_mem_handles, m_magc_mark_bits.size(), m_magc_threads);
+    for (const auto& it : m_data)
+        marker.addRoot(it.second.value);
+    marker.markAll();
+    // merge into the (already flipped) mark bits, where every live handle starts out unmarked
+    for (std::size_t i = 0; i < m_magc_mark_bits.size(); i++) {
+        if (m_magc_mark_polarity)
+            m_magc_mark_bits[i] |= marker.markWord(i);
+        else
+            m_magc_mark_bits[i] &= ~marker.markWord(i);
+    }
+}
+
+template void BasicContext<RefCountingGC>::parallelMark();
+template void BasicContext<DeferredRefCountingGC>::parallelMark();
+template void BasicContext<TracingGC>::parallelMark();
+} // namespace rt
+} // namespace tlc
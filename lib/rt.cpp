@@ -1,306 +1,988 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <iterator>
-#include <unordered_set>
+#include <algorithm>
+#include <limits>
+#include <new>
 #include <utility>
 #include <unordered_map>
 #include <stdexcept>
 #include "tlc/rt.h"
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#endif
 
 namespace tlc {
 namespace rt {
-Value::Value(i64 data, ValueType type)
-    : data(data), type(type) {}
+// Memory handle ids encode the slot of the handle in the handle table in their lower 32 bits and the
+// generation of that slot above. Generations start at 1 and are kept to 30 bits, so valid ids are
+// always positive and also fit into the 63-bit payload of compact values.
+static constexpr i64 generation_mask = (i64(1) << 30) - 1;
+
+static i64 makeAllocId(i64 slot, i32 generation) {
+    return (i64(generation) << 32) | slot;
+}
 
-MemoryHandle::MemoryHandle(std::vector<Value> data, i64 alloc_id, i32 ref_count)
-    : data(std::move(data)), alloc_id(alloc_id), ref_count(ref_count), flags(0) {}
+// maximum number of slots alloc sweeps while looking for a free slot before growing the handle table
+static constexpr i64 alloc_sweep_limit = 64;
 
-void Context::assertValidMemHandle(const Value& value) {
-    if (value.type != ValueType::memory_handle || m_mem_handles.find(value.data) == m_mem_handles.end())
-        throw std::runtime_error("invalid memory handle");
+// number of entries the marker thread of a concurrent cycle scans per acquisition of the heap lock
+static constexpr i64 concurrent_mark_slice_steps = 4096;
+
+// number of slots a majorGC slice may sweep per step, checking a slot is far cheaper than scanning an entry
+static constexpr i64 sweep_slots_per_step = 64;
+// the roots are shaded in batches of this many buckets of m_data per budget step
+static constexpr std::size_t root_buckets_per_step = 64;
+
+static i32 allocIdGeneration(i64 alloc_id) {
+    return static_cast<i32>((alloc_id >> 32) & generation_mask);
 }
 
-void Context::incref(const Value& mem_handle) {
-    assertValidMemHandle(mem_handle);
-    i32& ref_count = m_mem_handles.at(mem_handle.data).ref_count;
-    ref_count++;
+
+MemoryHandle::MemoryHandle(i64 alloc_id, i32 ref_count)
+    : alloc_id(alloc_id), ref_count(ref_count), flags(0),
+      generation(allocIdGeneration(alloc_id)) {}
+
+/// Arena chunks and the nursery are mapped directly, so that freeing them (e.g. at the end of a compaction)
+/// returns their pages to the OS. Blocks of this size from operator new would come from the heap of the
+/// allocator once its dynamic mmap threshold has grown, where freeing them keeps the pages.
+static char* mapChunk(std::size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+    void* chunk = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (chunk == MAP_FAILED)
+        throw std::bad_alloc();
+    return static_cast<char*>(chunk);
+#else
+    return static_cast<char*>(::operator new(size));
+#endif
 }
 
-void Context::decref(const Value& mem_handle) {
-    assertValidMemHandle(mem_handle);
-    i32& ref_count = m_mem_handles.at(mem_handle.data).ref_count;
-    if (--ref_count <= 0)
-        m_gc_candidates.emplace_back(mem_handle.data);
+static void unmapChunk(void* chunk, std::size_t size) {
+#if defined(__unix__) || defined(__APPLE__)
+    if (chunk)
+        munmap(chunk, size);
+#else
+    ::operator delete(chunk);
+#endif
 }
 
-Value Context::alloc(i64 size) {
-    if (size < 0)
-        throw std::runtime_error("size < 0 is not allowed in allocation");
-    i64 alloc_id = m_alloc_counter++;
-    m_mem_handles.emplace(alloc_id, std::move(MemoryHandle(std::vector<Value>(size), alloc_id, 0)));
-    return Value(alloc_id, ValueType::memory_handle);
+/// refill a size class by carving a block off the current chunk, starting a new chunk if it is used up
+Value* PayloadArena::carve(std::size_t size_class) {
+    std::size_t block_size = (std::size_t(1) << size_class) * sizeof(Value);
+    if (static_cast<std::size_t>(m_chunk_end - m_chunk_cursor) < block_size) {
+        m_chunk_cursor = mapChunk(chunk_size);
+        m_chunk_end = m_chunk_cursor + chunk_size;
+        m_chunks.push_back(m_chunk_cursor);
+    }
+    Value* block = reinterpret_cast<Value*>(m_chunk_cursor);
+    m_chunk_cursor += block_size;
+    return block;
 }
 
-void Context::push(Value array, Value value) {
-    assertValidMemHandle(array);
-    MemoryHandle& mh = m_mem_handles.at(array.data);
-#ifndef NO_MINOR_GC
-    if (value.type == ValueType::memory_handle)
-        incref(value);
-#endif
-    mh.data.emplace_back(value);
-}
-
-Value Context::pop(Value array) {
-    assertValidMemHandle(array);
-    MemoryHandle& mh = m_mem_handles.at(array.data);
-    if (mh.data.size() == 0)
-        throw std::runtime_error("cannot pop from empty array");
-    Value value = mh.data.back();
-#ifndef NO_MINOR_GC
-    if (value.type == ValueType::memory_handle)
-        decref(value);
-#endif
-    mh.data.pop_back();
-    return value;
-}
-
-void Context::write(Value array, i64 index, Value value) {
-    assertValidMemHandle(array);
-    MemoryHandle& mh = m_mem_handles.at(array.data);
-    if (index < 0 || index >= mh.data.size())
-        throw std::runtime_error("invalid index for data chunk of size " + std::to_string(mh.data.size()));
-#ifndef NO_MINOR_GC
-    Value& current = mh.data[index];
-    if (current.type == ValueType::memory_handle)
-        decref(current);
-    if (value.type == ValueType::memory_handle)
-        incref(value);
-#endif
-    mh.data[index] = value;
+/// move the values to a larger arena block
+void Payload::grow(std::size_t min_capacity, PayloadArena& arena, bool young) {
+    // doubling stops at the maximum, larger requests are rejected by the arena
+    std::size_t doubled = std::min(2 * m_capacity, PayloadArena::max_values);
+    std::size_t capacity = PayloadArena::capacityFor(std::max(min_capacity, doubled));
+    Value* block = young ? arena.allocateYoung(capacity) : arena.allocate(capacity);
+    std::copy(begin(), end(), block);
+    if (!isInline())
+        arena.deallocate(m_heap, m_capacity);
+    m_heap = block;
+    m_capacity = capacity;
+}
+
+/// the nursery is created on first use, once it is full, young payloads are allocated like old ones
+Value* PayloadArena::allocateYoungSlow(std::size_t n) {
+    if (m_nursery || n > nursery_size / sizeof(Value))
+        return allocate(n);
+    m_nursery = mapChunk(nursery_size);
+    m_nursery_cursor = m_nursery;
+    m_nursery_end = m_nursery + nursery_size;
+    return allocateYoung(n);
+}
+
+/// detach all chunks such that every block allocated from now on is carved from fresh ones
+void PayloadArena::beginCompaction() {
+    m_old_chunks.insert(m_old_chunks.end(), m_chunks.begin(), m_chunks.end());
+    m_chunks.clear();
+    std::fill(std::begin(m_free_lists), std::end(m_free_lists), nullptr);
+    m_chunk_cursor = nullptr;
+    m_chunk_end = nullptr;
+}
+
+void PayloadArena::endCompaction() {
+    for (void* chunk : m_old_chunks)
+        unmapChunk(chunk, chunk_size);
+    m_old_chunks.clear();
+}
+
+PayloadArena::~PayloadArena() {
+    endCompaction();
+    for (void* chunk : m_chunks)
+        unmapChunk(chunk, chunk_size);
+    unmapChunk(m_nursery, nursery_size);
 }
 
-Value Context::read(Value array, i64 index) {
-    assertValidMemHandle(array);
-    MemoryHandle& mh = m_mem_handles.at(array.data);
-    if (index < 0 || index >= mh.data.size())
-        throw std::runtime_error("invalid index for data chunk of size " + std::to_string(mh.data.size()));
-    return mh.data[index];
+void uncheckedAccessViolation(const char* condition) {
+    std::fprintf(stderr, "tlcrt: unchecked access violates its precondition: %s\n", condition);
+    std::abort();
 }
 
-void Context::defineFunction(FunT id, void *fun) {
+template <typename Policy>
+void BasicContext<Policy>::throwInvalidHandle() {
+    throw std::runtime_error("invalid memory handle");
+}
+
+template <typename Policy>
+void BasicContext<Policy>::throwInvalidIndex(std::size_t size) {
+    throw std::runtime_error("invalid index for data chunk of size " + std::to_string(size));
+}
+
+template <typename Policy>
+void BasicContext<Policy>::throwEmptyPop() {
+    throw std::runtime_error("cannot pop from empty array");
+}
+
+template <typename Policy>
+Value BasicContext<Policy>::alloc(i64 size) {
+    if (size < 0)
+        throw std::runtime_error("size < 0 is not allowed in allocation");
+    if (static_cast<std::size_t>(size) > PayloadArena::max_values)
+        throw std::runtime_error("size exceeds the maximum array size in allocation");
+    auto lock = lockHeap();
+    // lazily reclaim garbage of the last cycle before growing the handle table
+    for (i64 n = 0; m_sweep_pending && m_free_slots.empty() && n < alloc_sweep_limit; n++)
+        sweepNextSlot();
+    // the slot is only committed once its payload is allocated, such that a failed allocation changes nothing
+    i64 slot;
+    if (!m_free_slots.empty()) {
+        slot = m_free_slots.back();
+        MemoryHandle& mh = m_mem_handles[slot];
+        mh.data.resize(size, m_payload_arena, m_generational);
+        m_free_slots.pop_back();
+        mh.alloc_id = makeAllocId(slot, mh.generation);
+        mh.ref_count = 0;
+    } else {
+        slot = m_mem_handles.size();
+        if (slot / 64 >= m_magc_mark_bits.size())
+            m_magc_mark_bits.push_back(0);
+        m_mem_handles.emplace_back(makeAllocId(slot, 1), 0);
+        try {
+            m_mem_handles.back().data.resize(size, m_payload_arena, m_generational);
+        } catch (...) {
+            m_mem_handles.pop_back();
+            throw;
+        }
+    }
+    markSlot(slot);
+    MemoryHandle& mh = m_mem_handles[slot];
+    if (m_generational) {
+        mh.flags |= flag_young;
+        m_young_handles.push_back(mh.alloc_id);
+    }
+    accountAllocation(sizeof(MemoryHandle) + mh.data.bytes());
+    if constexpr (Policy::counts_references && !Policy::counts_root_references) {
+        // zero count table: new handles are only referenced by variables (if at all), which are not counted
+        queueCandidate(mh);
+    }
+    return Value(mh.alloc_id, ValueType::memory_handle);
+}
+
+template <typename Policy>
+void BasicContext<Policy>::defineFunction(FunT id, void *fun) {
     m_functions[id] = fun;
 }
 
-void Context::eraseFunction(FunT id) {
+template <typename Policy>
+void BasicContext<Policy>::eraseFunction(FunT id) {
     if (!funIsDefined(id))
         throw std::runtime_error("tried to erase undefined function");
     m_functions.erase(id);
 }
 
-void Context::assign(VarT id, Value value) {
-#ifndef NO_MINOR_GC
-    Value& current = m_data[id];
-    if (current.type == ValueType::memory_handle)
-        decref(current);
-    if (value.type == ValueType::memory_handle)
-        incref(value);
-#endif
-    m_data[id] = value;
+template <typename Policy>
+void BasicContext<Policy>::assign(VarT id, Value value) {
+    auto lock = lockHeap();
+    VariableSlot& var = m_data[id];
+    if constexpr (Policy::counts_root_references) {
+        if (var.value.type == ValueType::memory_handle)
+            decref(var.value);
+        if (value.type == ValueType::memory_handle)
+            incref(value);
+    } else if constexpr (Policy::counts_references) {
+        if (!var.logged) {
+            var.logged = true;
+            m_root_log.emplace_back(id, var.value);
+        }
+    }
+    // roots are only scanned when a cycle begins, thus values stored into variables need the barrier as well
+    writeBarrier(value);
+    var.value = value;
 }
 
-void Context::erase(VarT id) {
-    if (!varIsDefined(id))
+template <typename Policy>
+void BasicContext<Policy>::erase(VarT id) {
+    auto it = m_data.find(id);
+    if (it == m_data.end())
         throw std::runtime_error("tried to erase undefined variable");
-#ifndef NO_MINOR_GC
-    const Value& value = m_data[id];
-    if (value.type == ValueType::memory_handle)
-        decref(value);
-#endif
-    m_data.erase(id);
+    if constexpr (Policy::counts_root_references) {
+        if (it->second.value.type == ValueType::memory_handle)
+            decref(it->second.value);
+    } else if constexpr (Policy::counts_references) {
+        if (!it->second.logged)
+            m_root_log.emplace_back(id, it->second.value);
+    }
+    m_data.erase(it);
 }
 
-bool Context::varIsDefined(VarT id) {
+template <typename Policy>
+bool BasicContext<Policy>::varIsDefined(VarT id) {
     return m_data.find(id) != m_data.end();
 }
 
-bool Context::funIsDefined(FunT id) {
+template <typename Policy>
+bool BasicContext<Policy>::funIsDefined(FunT id) {
     return m_functions.find(id) != m_functions.end();
 }
 
 /// decref all live peers
-void Context::decoupleMemHandle(const MemoryHandle& mh) {
-#ifndef NO_MINOR_GC
-    for (const Value& v : mh.data)
-        if (v.type == ValueType::memory_handle && m_mem_handles.find(v.data) != m_mem_handles.end())
-            decref(v);
-#endif
+template <typename Policy>
+void BasicContext<Policy>::decoupleMemHandle(const MemoryHandle& mh) {
+    if constexpr (Policy::counts_references)
+        for (const Value& v : mh.data)
+            if (v.type == ValueType::memory_handle && findMemHandle(v.data))
+                decref(v);
 }
 
-/// free memory
-void Context::destroyMemHandle(const MemoryHandle& mh) {
-    m_mem_handles.erase(mh.alloc_id);
+/// free memory and invalidate all ids referring to the handle
+template <typename Policy>
+void BasicContext<Policy>::destroyMemHandle(MemoryHandle& mh) {
+    i64 slot = allocIdSlot(mh.alloc_id);
+    m_live_bytes -= sizeof(MemoryHandle) + mh.data.bytes();
+    mh.data.release(m_payload_arena);
+    mh.alloc_id = 0;
+    mh.flags = 0;
+    // a slot whose generation is exhausted is retired instead of wrapping around, because a wrapped
+    // generation would make long-stale ids referring to the slot valid again
+    if (mh.generation < generation_mask) {
+        mh.generation++;
+        m_free_slots.push_back(slot);
+    }
 }
 
-/// batch release garbage memory handles by first decoupling all of them, then destroying them
-void Context::releaseGarbage(const std::vector<i64>& garbage_allocs) {
-    m_release_tmp_valid_garbage_allocs.clear();
-    for (const auto ga : garbage_allocs)
-        if (m_mem_handles.find(ga) != m_mem_handles.end())
-            m_release_tmp_valid_garbage_allocs.emplace_back(ga);
-    for (const auto ga : m_release_tmp_valid_garbage_allocs) {
-        const MemoryHandle& mh = m_mem_handles.at(ga);
-        decoupleMemHandle(mh);
+/// batch release garbage memory handles, ids that are invalid (e.g. duplicates) are skipped
+template <typename Policy>
+void BasicContext<Policy>::releaseGarbage(const std::vector<i64>& garbage_allocs) {
+    for (const auto ga : garbage_allocs) {
+        if (MemoryHandle* mh = findMemHandle(ga)) {
+            decoupleMemHandle(*mh);
+            destroyMemHandle(*mh);
+        }
     }
-    for (const auto ga : m_release_tmp_valid_garbage_allocs) {
-        const MemoryHandle& mh = m_mem_handles.at(ga);
+}
+
+/// releases a handle the lazy sweep has not reached yet (i.e. garbage of the last major cycle) ahead of time
+template <typename Policy>
+void BasicContext<Policy>::sweepEarly(i64 alloc_id) {
+    MemoryHandle& mh = m_mem_handles[allocIdSlot(alloc_id)];
+    if (mh.alloc_id == alloc_id) {
+        decoupleMemHandle(mh);
         destroyMemHandle(mh);
     }
 }
 
-/// ref counting without cycle detection (thus major GC is needed)
-void Context::minorGC() {
-#ifndef NO_MINOR_GC
-    m_migc_tmp_garbage_allocs.clear();
-
-    for (i64 p : m_gc_candidates) {
-        if (m_mem_handles.find(p) == m_mem_handles.end())
-            continue;  // already invalidated by majorGC
-        const MemoryHandle& mh = m_mem_handles.at(p);
-        if (mh.ref_count <= 0)
-            m_migc_tmp_garbage_allocs.emplace_back(p);
+/// old arrays that receive young handles are remembered as roots of the next youngGC
+template <typename Policy>
+void BasicContext<Policy>::rememberIfYoung(MemoryHandle& mh, const Value& value) {
+    const MemoryHandle* target = findMemHandle(value.data);
+    if (target && (target->flags & flag_young)) {
+        mh.flags |= flag_remembered;
+        m_remembered_handles.push_back(mh.alloc_id);
     }
-    releaseGarbage(m_migc_tmp_garbage_allocs);
+}
 
-    m_gc_candidates.clear();
-#endif
+/// mark a value reachable by the youngGC and queue it for scanning if it is an unmarked young handle
+template <typename Policy>
+void BasicContext<Policy>::shadeYoung(const Value& value) {
+    if (value.type != ValueType::memory_handle)
+        return;
+    MemoryHandle* mh = findMemHandle(value.data);
+    if (!mh || (mh->flags & (flag_young | flag_young_marked)) != flag_young)
+        return;
+    mh->flags |= flag_young_marked;
+    m_ygc_mark_stack.push_back(value.data);
 }
 
-/// global mark and sweep
-void Context::majorGC(i64 max_steps) {
-    if (max_steps == -1) {
-        m_magc_tmp_garbage_allocs.clear();
-        m_magc_next_mem_handles.clear();
-        m_magc_visited_mem_handles.clear();
-        m_magc_new_mem_handles.clear();
-
-        for (auto& it : m_mem_handles) {
-            MemoryHandle& mh = it.second;
-            mh.flags &= 0xFFFFFFFE;
+template <typename Policy>
+void BasicContext<Policy>::setGenerationalGC(bool enabled) {
+    auto lock = lockHeap();
+    if (!enabled) {
+        // promote everything, there is no young generation without the barrier maintaining it
+        for (i64 p : m_young_handles) {
+            if (MemoryHandle* mh = findMemHandle(p)) {
+                mh->flags &= ~(flag_young | flag_young_marked);
+                mh->data.evacuate(m_payload_arena);
+            } else {
+                sweepEarly(p);
+            }
+        }
+        for (i64 p : m_remembered_handles)
+            if (MemoryHandle* mh = findMemHandle(p))
+                mh->flags &= ~flag_remembered;
+        m_young_handles.clear();
+        m_remembered_handles.clear();
+        m_payload_arena.resetNursery();
+    }
+    m_generational = enabled;
+}
+
+/// Collects only the handles allocated since the last youngGC. Traces from the variables and the
+/// remembered old arrays through young handles, releases the unreached ones and promotes the rest.
+template <typename Policy>
+void BasicContext<Policy>::youngGC() {
+    auto lock = lockHeap();
+    m_ygc_mark_stack.clear();
+    for (const auto& it : m_data)
+        shadeYoung(it.second.value);
+    for (i64 p : m_remembered_handles) {
+        if (MemoryHandle* mh = findMemHandle(p)) {
+            mh->flags &= ~flag_remembered;
+            for (const Value& v : mh->data)
+                shadeYoung(v);
         }
+    }
+    while (!m_ygc_mark_stack.empty()) {
+        i64 p = m_ygc_mark_stack.back();
+        m_ygc_mark_stack.pop_back();
+        for (const Value& v : findMemHandle(p)->data)
+            shadeYoung(v);
+    }
 
-        for (const auto& it : m_data) {
-            const Value& v = it.second;
-            if (v.type == ValueType::memory_handle)
-                m_magc_next_mem_handles.emplace(v.data);
+    m_ygc_tmp_garbage_allocs.clear();
+    for (i64 p : m_young_handles) {
+        MemoryHandle* mh = findMemHandle(p);
+        if (!mh) {
+            // already released by another GC, or garbage the lazy sweep would read after the nursery is reset
+            sweepEarly(p);
+            continue;
+        }
+        if (mh->flags & flag_young_marked) {
+            mh->flags &= ~(flag_young | flag_young_marked);
+            mh->data.evacuate(m_payload_arena);
+        } else {
+            m_ygc_tmp_garbage_allocs.emplace_back(p);
         }
+    }
+    releaseGarbage(m_ygc_tmp_garbage_allocs);
+    m_young_handles.clear();
+    m_remembered_handles.clear();
+    // every young handle was either promoted and evacuated or released
+    m_payload_arena.resetNursery();
+}
 
-        while (!m_magc_next_mem_handles.empty()) {
-            for (i64 p : m_magc_next_mem_handles)
-                m_magc_visited_mem_handles.emplace(p);
-
-            for (i64 p : m_magc_next_mem_handles) {
-                MemoryHandle& mh = m_mem_handles.at(p);
-                mh.flags |= 0x1;
-                for (Value& v : mh.data) {
-                    if (v.type == ValueType::memory_handle
-                        && m_magc_visited_mem_handles.find(v.data) == m_magc_visited_mem_handles.end()) {
-                        m_magc_new_mem_handles.emplace(v.data);
-                    }
-                }
+/// ref counting without cycle detection (thus major GC is needed). Releasing a handle decrefs its
+/// children, which queues those that die with it, so whole dead structures are released by one unlimited call.
+/// A handle released within the budget counts as a step, stale candidates only count towards the deadline.
+template <typename Policy>
+bool BasicContext<Policy>::minorGCSlice(GCBudget& budget) {
+    if constexpr (!Policy::counts_references)
+        return true;
+    auto lock = lockHeap();
+    if constexpr (!Policy::counts_root_references)
+        applyRootLog();
+    return releaseCandidates(budget);
+}
+
+/// release queued handles whose count is zero until none are left (returns true) or the budget is exhausted
+template <typename Policy>
+bool BasicContext<Policy>::releaseCandidates(GCBudget& budget) {
+    while (!m_gc_candidates.empty()) {
+        i64 p = m_gc_candidates.back();
+        MemoryHandle* mh = findMemHandle(p);
+        // skip handles already released by another GC or referenced again since they were queued
+        // (the latter are queued again once their count drops to zero)
+        if (!mh || mh->ref_count > 0) {
+            m_gc_candidates.pop_back();
+            if (mh) {
+                mh->flags &= ~flag_queued;
+                // variable references it gained and lost between two collections went unnoticed
+                if constexpr (!Policy::counts_root_references)
+                    bufferCycleRoot(*mh);
             }
+            if (budget.tick())
+                return false;
+            continue;
+        }
+        if (budget.step())
+            return false;
+        m_gc_candidates.pop_back();
+        decoupleMemHandle(*mh);
+        destroyMemHandle(*mh);
+    }
+    return true;
+}
 
-            std::unordered_set<i64> tmp = std::move(m_magc_next_mem_handles);
-            m_magc_next_mem_handles = m_magc_new_mem_handles;
-            m_magc_new_mem_handles = std::move(tmp);
-            m_magc_new_mem_handles.clear();
+/// deferred reference counting: the counts include the references variables held at the last collection. The
+/// variables assigned or erased since then are brought up to date, all increments before any decrement such that
+/// no count drops to zero on the way.
+template <typename Policy>
+void BasicContext<Policy>::applyRootLog() {
+    // only variables of the deferred policy can be logged
+    if constexpr (Policy::counts_references && !Policy::counts_root_references) {
+        // a variable erased and assigned again is logged twice, but its current value is counted once
+        for (const auto& it : m_root_log) {
+            auto var = m_data.find(it.first);
+            if (var != m_data.end() && var->second.logged) {
+                var->second.logged = false;
+                if (MemoryHandle* mh = findMemHandle(var->second.value))
+                    mh->ref_count++;
+            }
         }
+        // previous values that were released by majorGC in the meantime are skipped
+        for (const auto& it : m_root_log)
+            if (MemoryHandle* mh = findMemHandle(it.second))
+                decref(*mh);
+        m_root_log.clear();
+    }
+}
 
-        for (const auto& it : m_mem_handles) {
-            const MemoryHandle& mh = it.second;
-            if (!(mh.flags & 0x1))
-                m_magc_tmp_garbage_allocs.emplace_back(mh.alloc_id);
+template <typename Policy>
+bool BasicContext<Policy>::minorGC(i64 max_steps) {
+    GCBudget budget(max_steps == -1 ? std::numeric_limits<i64>::max() : max_steps);
+    return minorGCSlice(budget);
+}
+
+template <typename Policy>
+bool BasicContext<Policy>::minorGC(std::chrono::nanoseconds budget) {
+    GCBudget deadline(budget);
+    return minorGCSlice(deadline);
+}
+
+/// trial deletion: subtracts the references internal to the subgraph reachable from the handle, coloring it gray
+template <typename Policy>
+void BasicContext<Policy>::cycleMarkGray(MemoryHandle& root) {
+    if (root.flags & flag_gray)
+        return;
+    root.flags |= flag_gray;
+    m_cycle_stack.push_back(root.alloc_id);
+    while (!m_cycle_stack.empty()) {
+        const MemoryHandle& mh = *findMemHandle(m_cycle_stack.back());
+        m_cycle_stack.pop_back();
+        for (const Value& v : mh.data) {
+            MemoryHandle* peer = v.type == ValueType::memory_handle ? findMemHandle(v.data) : nullptr;
+            if (!peer)
+                continue;
+            peer->ref_count--;
+            if (!(peer->flags & flag_gray)) {
+                peer->flags |= flag_gray;
+                m_cycle_stack.push_back(peer->alloc_id);
+            }
         }
-        releaseGarbage(m_magc_tmp_garbage_allocs);
-    } else {
-        if (m_magc_state == 0) {
-            m_magc_tmp_garbage_allocs.clear();
-            m_magc_next_mem_handles.clear();
-            m_magc_visited_mem_handles.clear();
-            m_magc_new_mem_handles.clear();
-            m_magc_state++;
+    }
+}
+
+/// gray handles still referenced from outside of the gray subgraph are live and so is everything they reach,
+/// the remaining ones are colored white (garbage)
+template <typename Policy>
+void BasicContext<Policy>::cycleScan(MemoryHandle& root) {
+    m_cycle_stack.push_back(root.alloc_id);
+    while (!m_cycle_stack.empty()) {
+        MemoryHandle& mh = *findMemHandle(m_cycle_stack.back());
+        m_cycle_stack.pop_back();
+        if (!(mh.flags & flag_gray))
+            continue;
+        if (mh.ref_count > 0) {
+            cycleScanBlack(mh);
+            continue;
         }
+        mh.flags = (mh.flags & ~flag_gray) | flag_white;
+        for (const Value& v : mh.data)
+            if (MemoryHandle* peer = v.type == ValueType::memory_handle ? findMemHandle(v.data) : nullptr)
+                m_cycle_stack.push_back(peer->alloc_id);
+    }
+}
 
-        if (m_magc_state == 1) {
-            for (auto& it : m_mem_handles) {
-                MemoryHandle& mh = it.second;
-                mh.flags &= 0xFFFFFFFE;
+/// undoes the trial deletion for everything reachable from a live handle
+template <typename Policy>
+void BasicContext<Policy>::cycleScanBlack(MemoryHandle& root) {
+    root.flags &= ~(flag_gray | flag_white);
+    m_cycle_tmp_stack.push_back(root.alloc_id);
+    while (!m_cycle_tmp_stack.empty()) {
+        const MemoryHandle& mh = *findMemHandle(m_cycle_tmp_stack.back());
+        m_cycle_tmp_stack.pop_back();
+        for (const Value& v : mh.data) {
+            MemoryHandle* peer = v.type == ValueType::memory_handle ? findMemHandle(v.data) : nullptr;
+            if (!peer)
+                continue;
+            peer->ref_count++;
+            if (peer->flags & (flag_gray | flag_white)) {
+                peer->flags &= ~(flag_gray | flag_white);
+                m_cycle_tmp_stack.push_back(peer->alloc_id);
             }
-            m_magc_state++;
         }
+    }
+}
 
-        if (m_magc_state == 2) {
-            for (const auto& it : m_data) {
-                const Value& v = it.second;
-                if (v.type == ValueType::memory_handle)
-                    m_magc_next_mem_handles.emplace(v.data);
+/// gathers the white handles reachable from the handle into m_cycle_tmp_garbage_allocs
+template <typename Policy>
+void BasicContext<Policy>::cycleCollectWhite(MemoryHandle& root) {
+    if (!(root.flags & flag_white))
+        return;
+    root.flags &= ~flag_white;
+    m_cycle_stack.push_back(root.alloc_id);
+    while (!m_cycle_stack.empty()) {
+        i64 p = m_cycle_stack.back();
+        m_cycle_stack.pop_back();
+        m_cycle_tmp_garbage_allocs.push_back(p);
+        for (const Value& v : findMemHandle(p)->data) {
+            MemoryHandle* peer = v.type == ValueType::memory_handle ? findMemHandle(v.data) : nullptr;
+            if (peer && (peer->flags & flag_white)) {
+                peer->flags &= ~flag_white;
+                m_cycle_stack.push_back(peer->alloc_id);
             }
-            m_magc_state++;
         }
+    }
+}
 
-        i64 step_counter = 0;
-        while (!m_magc_next_mem_handles.empty()) {
-            if (m_magc_state == 3) {
-                for (i64 p : m_magc_next_mem_handles)
-                    m_magc_visited_mem_handles.emplace(p);
-                m_magc_state++;
-            }
+/// drop buffered roots that were released (their ids are stale) or whose count dropped to zero (those are left to
+/// minorGC and buffered again if they lose a reference while still referenced)
+template <typename Policy>
+void BasicContext<Policy>::pruneCycleRoots() {
+    std::size_t n_roots = 0;
+    for (i64 p : m_cycle_roots) {
+        MemoryHandle* mh = findMemHandle(p);
+        if (!mh)
+            continue;
+        if (mh->ref_count > 0)
+            m_cycle_roots[n_roots++] = p;
+        else
+            mh->flags &= ~flag_buffered;
+    }
+    m_cycle_roots.resize(n_roots);
+    m_cycle_roots_limit = std::max(m_cycle_roots_limit, 2 * n_roots);
+}
+
+/// Synchronous cycle collection by trial deletion (Bacon & Rajan). Only the subgraphs reachable from handles
+/// that lost a reference without dropping to zero are examined, garbage cycles among them are released.
+template <typename Policy>
+void BasicContext<Policy>::collectCycles() {
+    if constexpr (!Policy::counts_references)
+        return;
+    auto lock = lockHeap();
+    if constexpr (!Policy::counts_root_references) {
+        // references of variables must keep cycles alive as well. Handles allocated since the last minorGC may
+        // have been referenced by variables that are gone by now, so the referenced ones are possible roots.
+        applyRootLog();
+        for (i64 p : m_gc_candidates)
+            if (MemoryHandle* mh = findMemHandle(p); mh && mh->ref_count > 0)
+                bufferCycleRoot(*mh);
+    }
+    pruneCycleRoots();
+    for (i64 p : m_cycle_roots) {
+        MemoryHandle& mh = *findMemHandle(p);
+        mh.flags &= ~flag_buffered;
+        cycleMarkGray(mh);
+    }
+    for (i64 p : m_cycle_roots)
+        cycleScan(*findMemHandle(p));
+    m_cycle_tmp_garbage_allocs.clear();
+    for (i64 p : m_cycle_roots)
+        cycleCollectWhite(*findMemHandle(p));
+    m_cycle_roots.clear();
+    // the references of the garbage to live handles were already subtracted by the trial deletion
+    for (i64 p : m_cycle_tmp_garbage_allocs)
+        destroyMemHandle(*findMemHandle(p));
+}
+
+template <typename Policy>
+void BasicContext<Policy>::markSlot(i64 slot) {
+    std::uint64_t bit = std::uint64_t(1) << (slot % 64);
+    if (m_magc_mark_polarity)
+        m_magc_mark_bits[slot / 64] |= bit;
+    else
+        m_magc_mark_bits[slot / 64] &= ~bit;
+}
+
+/// mark a value reachable and queue its entries for scanning if it is an unmarked memory handle
+template <typename Policy>
+void BasicContext<Policy>::shade(const Value& value) {
+    if (value.type != ValueType::memory_handle || !findMemHandle(value.data))
+        return;
+    i64 slot = allocIdSlot(value.data);
+    if (isMarked(slot))
+        return;
+    markSlot(slot);
+    m_magc_mark_stack.push_back(value.data);
+}
+
+GCBudget::GCBudget(i64 max_steps)
+    : steps(max_steps) {}
+
+GCBudget::GCBudget(std::chrono::nanoseconds duration)
+    : steps(std::numeric_limits<i64>::max()), timed(true),
+      deadline(std::chrono::steady_clock::now() + duration) {}
+
+/// consumes a unit of work in any phase, returns true once the deadline has passed
+bool GCBudget::tick() {
+    if (!timed || --clock_countdown > 0)
+        return false;
+    clock_countdown = clock_check_interval;
+    return std::chrono::steady_clock::now() >= deadline;
+}
+
+/// consumes a step (e.g. one scanned array entry), returns true once the budget is exhausted
+bool GCBudget::step() {
+    if (steps <= 0)
+        return true;
+    steps--;
+    return tick();
+}
+
+/// Begins a cycle by flipping the meaning of the mark bits instead of clearing them. Every live handle is
+/// marked at this point (it either survived the last cycle or was born marked), so after the flip, all
+/// of them are unmarked. Requires the garbage of the last cycle to be swept completely.
+template <typename Policy>
+void BasicContext<Policy>::flipMarks() {
+    m_magc_mark_polarity = !m_magc_mark_polarity;
+    m_magc_mark_stack.clear();
+    m_magc_last_handle = 0;
+    m_magc_last_handle_entry = 0;
+    m_magc_phase = magc_scanning_roots;
+    m_magc_root_bucket = 0;
+    m_magc_root_buckets = m_data.bucket_count();
+}
+
+/// flip the marks and shade the roots in one go
+template <typename Policy>
+void BasicContext<Policy>::beginMark() {
+    GCBudget unlimited(std::numeric_limits<i64>::max());
+    flipMarks();
+    scanRootsSlice(unlimited);
+}
+
+/// Drops the cycle in progress (if any). Its marks are partial, thus every mark bit is reset to the
+/// current polarity to restore the invariant that all live handles are marked between cycles.
+template <typename Policy>
+void BasicContext<Policy>::abandonCycle() {
+    if (m_magc_state == magc_concurrent) {
+        m_cgc_abort.store(true, std::memory_order_relaxed);
+        m_cgc_thread.join();
+    }
+    if (m_magc_state == magc_idle)
+        return;
+    std::fill(m_magc_mark_bits.begin(), m_magc_mark_bits.end(), m_magc_mark_polarity ? ~std::uint64_t(0) : 0);
+    m_magc_mark_stack.clear();
+    m_magc_last_handle = 0;
+    m_magc_state = magc_idle;
+}
+
+/// shade the variables bucket by bucket, which stays resumable as long as m_data is not rehashed
+template <typename Policy>
+bool BasicContext<Policy>::scanRootsSlice(GCBudget& budget) {
+    if (m_magc_root_buckets != m_data.bucket_count()) {
+        // buckets were redistributed, start over (already shaded roots are skipped cheaply)
+        m_magc_root_bucket = 0;
+        m_magc_root_buckets = m_data.bucket_count();
+    }
+    while (m_magc_root_bucket < m_magc_root_buckets) {
+        for (auto it = m_data.begin(m_magc_root_bucket); it != m_data.end(m_magc_root_bucket); ++it)
+            shade(it->second.value);
+        // batches are charged once shaded, thus every slice shades at least one batch
+        bool exhausted = ++m_magc_root_bucket % root_buckets_per_step == 0 ? budget.step() : budget.tick();
+        if (exhausted && m_magc_root_bucket < m_magc_root_buckets)
+            return false;
+    }
+    m_magc_phase = magc_marking;
+    return true;
+}
 
-            if (m_magc_state == 4) {
-                i64 ih = 0, ihe = 0;
-                for (i64 p : m_magc_next_mem_handles) {
-                    if (ih < m_magc_last_handle) {
-                        ih++;
-                        continue;
-                    }
-                    MemoryHandle& mh = m_mem_handles.at(p);
-                    mh.flags |= 0x1;
-                    for (Value& v : mh.data) {
-                        if (ihe < m_magc_last_handle_entry) {
-                            ihe++;
-                            continue;
-                        }
-                        if (step_counter >= max_steps)
-                            return;
-                        if (v.type == ValueType::memory_handle
-                            && m_magc_visited_mem_handles.find(v.data) == m_magc_visited_mem_handles.end()) {
-                            m_magc_new_mem_handles.emplace(v.data);
-                        }
-                        m_magc_last_handle_entry++, ihe++, step_counter++;
-                    }
-                    m_magc_last_handle_entry = 0, ihe = 0;
-                    m_magc_last_handle++, ih++;
-                }
-                m_magc_state++;
+/// scan queued handles until none are left (returns true) or the budget is exhausted
+template <typename Policy>
+bool BasicContext<Policy>::markSlice(GCBudget& budget) {
+    while (m_magc_last_handle || !m_magc_mark_stack.empty()) {
+        if (!m_magc_last_handle) {
+            m_magc_last_handle = m_magc_mark_stack.back();
+            m_magc_last_handle_entry = 0;
+            m_magc_mark_stack.pop_back();
+        }
+        // the handle may have been released by the minor GC since it was queued
+        if (const MemoryHandle* mh = findMemHandle(m_magc_last_handle)) {
+            for (; m_magc_last_handle_entry < mh->data.size(); m_magc_last_handle_entry++) {
+                if (budget.step())
+                    return false;
+                shade(mh->data[m_magc_last_handle_entry]);
             }
+        }
+        m_magc_last_handle = 0;
+    }
+    return true;
+}
+
+/// everything not marked by the cycle that just finished marking is garbage from now on
+template <typename Policy>
+void BasicContext<Policy>::beginSweep() {
+    m_magc_state = magc_idle;
+    m_sweep_pending = !m_mem_handles.empty();
+    m_sweep_cursor = 0;
+    if (!m_sweep_pending)
+        updateGCTrigger();
+}
+
+/// release the handle at the sweep cursor if it is garbage and advance the cursor, returns whether it released
+template <typename Policy>
+bool BasicContext<Policy>::sweepNextSlot() {
+    MemoryHandle& mh = m_mem_handles[m_sweep_cursor];
+    bool garbage = mh.alloc_id && !isMarked(m_sweep_cursor);
+    if (garbage) {
+        decoupleMemHandle(mh);
+        destroyMemHandle(mh);
+    }
+    if (++m_sweep_cursor == m_mem_handles.size()) {
+        m_sweep_pending = false;
+        updateGCTrigger();
+    }
+    return garbage;
+}
+
+/// lazily release garbage until the budget is exhausted (returns false) or all of it is released, a step
+/// pays for checking the slots of one mark word or for releasing a handle (as in minorGC)
+template <typename Policy>
+bool BasicContext<Policy>::sweepSlice(GCBudget& budget) {
+    while (m_sweep_pending) {
+        if (m_sweep_cursor % sweep_slots_per_step == 0 && budget.step())
+            return false;
+        if (sweepNextSlot() && budget.step())
+            return false;
+    }
+    return true;
+}
+
+/// release all remaining garbage of the last cycle in one go
+template <typename Policy>
+void BasicContext<Policy>::finishSweep() {
+    while (m_sweep_pending)
+        sweepNextSlot();
+}
 
-            if (m_magc_state == 5) {
-                m_magc_last_handle = 0;
-                m_magc_last_handle_entry = 0;
-                std::unordered_set<i64> tmp = std::move(m_magc_next_mem_handles);
-                m_magc_next_mem_handles = m_magc_new_mem_handles;
-                m_magc_new_mem_handles = std::move(tmp);
-                m_magc_new_mem_handles.clear();
-                m_magc_state = 3;
+template <typename Policy>
+bool BasicContext<Policy>::sweepGC(i64 max_slots) {
+    auto lock = lockHeap();
+    for (i64 n = 0; m_sweep_pending && n != max_slots; n++)
+        sweepNextSlot();
+    return !m_sweep_pending;
+}
+
+template <typename Policy>
+void BasicContext<Policy>::setMajorGCThreads(i64 n_threads) {
+    if (n_threads < 0)
+        throw std::runtime_error("the number of majorGC threads must not be negative");
+    m_magc_threads = n_threads;
+}
+
+/// the heap may grow by the growth factor until the next cycle is triggered, once the last one is swept completely
+template <typename Policy>
+void BasicContext<Policy>::updateGCTrigger() {
+    m_gc_trigger = std::max(m_heap_budget, static_cast<std::size_t>(m_live_bytes * m_heap_growth_factor));
+}
+
+/// Pays off the debt of the pacer with a majorGC slice. The work of the slice is proportional to the bytes
+/// allocated since the last one, at a rate that sweeps the handle table and marks the live heap (twice over, as
+/// a margin) before the heap grows by another growth factor beyond the trigger.
+template <typename Policy>
+void BasicContext<Policy>::paceMajorGC() {
+    double runway = (m_heap_growth_factor - 1) * m_gc_trigger;
+    // the live bytes include unswept garbage, at more than one step per handle that also pays for releasing it
+    std::size_t cycle_steps = m_live_bytes / sizeof(Value) + m_mem_handles.size() / sweep_slots_per_step
+                              + m_data.bucket_count() / root_buckets_per_step;
+    double steps_per_byte = 2 * static_cast<double>(cycle_steps) / runway;
+    GCBudget budget(static_cast<i64>(m_gc_debt * steps_per_byte) + 1);
+    m_gc_debt = 0;
+    if (m_magc_state == magc_idle) {
+        // releasing the garbage of the last cycle may already bring the heap back below the trigger
+        sweepSlice(budget);
+        if (m_sweep_pending || m_live_bytes < m_gc_trigger)
+            return;
+    }
+    majorGCSlice(budget);
+}
+
+template <typename Policy>
+std::size_t BasicContext<Policy>::liveBytes() const {
+    return m_live_bytes;
+}
+
+template <typename Policy>
+std::size_t BasicContext<Policy>::allocatedBytes() const {
+    return m_allocated_bytes;
+}
+
+template <typename Policy>
+void BasicContext<Policy>::setHeapBudget(std::size_t bytes) {
+    m_heap_budget = bytes;
+    m_gc_debt = 0;
+    updateGCTrigger();
+}
+
+template <typename Policy>
+void BasicContext<Policy>::setHeapGrowthFactor(double factor) {
+    if (!(factor > 1))
+        throw std::runtime_error("the heap growth factor must be greater than 1");
+    m_heap_growth_factor = factor;
+    updateGCTrigger();
+}
+
+/// runs the phases of an incremental cycle until the budget is exhausted, returns whether the cycle finished
+template <typename Policy>
+bool BasicContext<Policy>::majorGCSlice(GCBudget& budget) {
+    if (m_magc_state == magc_concurrent) {
+        // the marker thread does the work, slices only finish the cycle once it is done
+        return finishConcurrentMajorGC(false);
+    }
+
+    if (m_magc_state == magc_idle) {
+        // the marks of the last cycle are needed until its garbage is released
+        if (!sweepSlice(budget))
+            return false;
+        m_magc_state = magc_incremental;
+        flipMarks();
+    }
+    if (m_magc_phase == magc_scanning_roots && !scanRootsSlice(budget))
+        return false;
+    if (m_magc_phase == magc_marking && !markSlice(budget))
+        return false;
+    beginSweep();
+    return true;
+}
+
+/// global mark and (lazy) sweep
+template <typename Policy>
+bool BasicContext<Policy>::majorGC(i64 max_steps) {
+    if (max_steps == -1) {
+        // a full collection supersedes any cycle in progress
+        abandonCycle();
+        finishSweep();
+        if (m_magc_threads > 0) {
+            flipMarks();
+            parallelMark();
+        } else {
+            GCBudget unlimited(std::numeric_limits<i64>::max());
+            beginMark();
+            markSlice(unlimited);
+        }
+        beginSweep();
+        if (m_compacting)
+            compactGC();
+        return true;
+    }
+    GCBudget budget(max_steps);
+    return majorGCSlice(budget);
+}
+
+template <typename Policy>
+bool BasicContext<Policy>::majorGC(std::chrono::nanoseconds budget) {
+    GCBudget deadline(budget);
+    return majorGCSlice(deadline);
+}
+
+/// marker thread body, marks in slices so the interpreter can interleave its heap accesses
+template <typename Policy>
+void BasicContext<Policy>::concurrentMark() {
+    while (!m_cgc_abort.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> lock(m_cgc_mutex);
+            GCBudget budget(concurrent_mark_slice_steps);
+            if (markSlice(budget)) {
+                m_cgc_marked.store(true, std::memory_order_release);
+                return;
             }
         }
+        std::this_thread::yield();
+    }
+}
+
+template <typename Policy>
+void BasicContext<Policy>::startConcurrentMajorGC() {
+    if (m_magc_state == magc_concurrent)
+        return;
+    // the root scan is the initial pause of the cycle
+    abandonCycle();
+    finishSweep();
+    m_magc_state = magc_concurrent;
+    beginMark();
+    m_cgc_marked.store(false, std::memory_order_relaxed);
+    m_cgc_abort.store(false, std::memory_order_relaxed);
+    m_cgc_thread = std::thread([this]() { concurrentMark(); });
+}
 
-        for (const auto& it : m_mem_handles) {
-            const MemoryHandle& mh = it.second;
-            if (!(mh.flags & 0x1))
-                m_magc_tmp_garbage_allocs.emplace_back(mh.alloc_id);
+template <typename Policy>
+bool BasicContext<Policy>::finishConcurrentMajorGC(bool wait) {
+    if (m_magc_state != magc_concurrent)
+        return true;
+    if (!wait && !m_cgc_marked.load(std::memory_order_acquire))
+        return false;
+    m_cgc_thread.join();
+    // final remark pause: scan what the write barrier queued after the marker thread finished
+    GCBudget unlimited(std::numeric_limits<i64>::max());
+    markSlice(unlimited);
+    beginSweep();
+    return true;
+}
+
+/// relocate the payload of a handle that was not relocated yet and queue it to relocate its entries
+template <typename Policy>
+inline void BasicContext<Policy>::relocatePayload(const Value& value) {
+    MemoryHandle* mh = findMemHandle(value);
+    if (!mh || (mh->flags & flag_relocated))
+        return;
+    mh->flags |= flag_relocated;
+    mh->data.relocate(m_payload_arena);
+    m_compact_stack.push_back(mh->alloc_id);
+}
+
+template <typename Policy>
+void BasicContext<Policy>::compactGC() {
+    auto lock = lockHeap();
+    // the payloads of unswept garbage would be read by the sweep after their chunks are gone
+    finishSweep();
+    m_payload_arena.beginCompaction();
+    for (const auto& it : m_data) {
+        relocatePayload(it.second.value);
+        while (!m_compact_stack.empty()) {
+            const MemoryHandle& mh = *findMemHandle(m_compact_stack.back());
+            m_compact_stack.pop_back();
+            for (const Value& v : mh.data)
+                relocatePayload(v);
         }
-        releaseGarbage(m_magc_tmp_garbage_allocs);
-        m_magc_state = 0;
     }
+    // handles no variable reaches (yet to be collected or only referenced by the embedder) are moved last
+    for (MemoryHandle& mh : m_mem_handles) {
+        if (!mh.alloc_id)
+            continue;
+        if (mh.flags & flag_relocated)
+            mh.flags &= ~flag_relocated;
+        else
+            mh.data.relocate(m_payload_arena);
+    }
+    m_payload_arena.endCompaction();
 }
+
+template <typename Policy>
+void BasicContext<Policy>::setCompactingGC(bool enabled) {
+    m_compacting = enabled;
+}
+
+template <typename Policy>
+BasicContext<Policy>::~BasicContext() {
+    abandonCycle();
+    // the arena releases its chunks by itself, but payloads beyond its size classes are separate allocations
+    for (MemoryHandle& mh : m_mem_handles)
+        mh.data.release(m_payload_arena);
+}
+
+template class BasicContext<RefCountingGC>;
+template class BasicContext<DeferredRefCountingGC>;
+template class BasicContext<TracingGC>;
 } // namespace rt
 } // namespace tlc
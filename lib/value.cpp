@@ -1,54 +1,33 @@
 #include <stdexcept>
+#include <string>
 #include "tlc/rt.h"
 
 namespace tlc {
 namespace rt {
-static bool compatibleTypes(ValueType a, ValueType b) {
-    return a == ValueType::integer && b == ValueType::integer;
+const char* statusMessage(Status status) {
+    switch (status) {
+    case Status::ok:
+        return "ok";
+    case Status::incompatible_types:
+        return "incompatible types of operation operands";
+    case Status::handle_operand:
+        return "cannot apply operator on memory handle";
+    case Status::invalid_handle:
+        return "invalid memory handle";
+    case Status::invalid_index:
+        return "invalid index for data chunk";
+    case Status::empty_pop:
+        return "cannot pop from empty array";
+    }
+    return "unknown status";
 }
 
-static void assertCompatibleTypes(ValueType a, ValueType b) {
-    if (!compatibleTypes(a, b))
-        throw std::runtime_error("incompatible types of operation operands");
+void Value::throwIncompatibleTypes() {
+    throw std::runtime_error("incompatible types of operation operands");
 }
 
-Value Value::toInteger() const {
-    return Value(data, ValueType::integer);
-}
-
-#define DEFINE_BINARY_OPERATOR(sign) \
-Value Value::operator sign(const Value& other) const { \
-    assertCompatibleTypes(type, other.type); \
-    return Value(data sign other.data, ValueType::integer); \
-}
-
-DEFINE_BINARY_OPERATOR(+);
-DEFINE_BINARY_OPERATOR(-);
-DEFINE_BINARY_OPERATOR(*);
-DEFINE_BINARY_OPERATOR(/);
-DEFINE_BINARY_OPERATOR(%);
-DEFINE_BINARY_OPERATOR(&);
-DEFINE_BINARY_OPERATOR(|);
-DEFINE_BINARY_OPERATOR(&&);
-DEFINE_BINARY_OPERATOR(||);
-DEFINE_BINARY_OPERATOR(<);
-DEFINE_BINARY_OPERATOR(>);
-DEFINE_BINARY_OPERATOR(<=);
-DEFINE_BINARY_OPERATOR(>=);
-DEFINE_BINARY_OPERATOR(==);
-DEFINE_BINARY_OPERATOR(!=);
-DEFINE_BINARY_OPERATOR(^);
-
-Value Value::operator!() const {
-    if (type != ValueType::integer)
-        throw std::runtime_error("cannot apply ! operator on memory handle");
-    return Value(!data, type);
-}
-
-Value Value::operator~() const {
-    if (type != ValueType::integer)
-        throw std::runtime_error("cannot apply ~ operator on memory handle");
-    return Value(~data, type);
+void Value::throwHandleOperand(const char* op) {
+    throw std::runtime_error(std::string("cannot apply ") + op + " operator on memory handle");
 }
 } // namespace rt
 } // namespace tlc
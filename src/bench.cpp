@@ -0,0 +1,64 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include "tlc/rt.h"
+
+using namespace tlc::rt;
+
+/// builds a tree of n_arrays live arrays with the given fanout, rooted in variable 1
+static void buildTree(Context& ctx, i64 n_arrays, i64 fanout) {
+    Value root = ctx.alloc(fanout);
+    ctx.assign(1, root);
+    std::vector<Value> frontier{root};
+    i64 n_allocated = 1;
+    for (std::size_t i = 0; n_allocated < n_arrays; i++) {
+        Value parent = frontier[i];
+        for (i64 j = 0; j < fanout && n_allocated < n_arrays; j++, n_allocated++) {
+            Value child = ctx.alloc(fanout);
+            ctx.write(parent, j, child);
+            frontier.push_back(child);
+        }
+    }
+}
+
+/// best of three full majorGC pauses in milliseconds, n_threads as in Context::setMajorGCThreads
+static double measurePause(Context& ctx, i64 n_threads) {
+    ctx.setMajorGCThreads(n_threads);
+    ctx.majorGC();  // warm up
+    double best_ms = 1e300;
+    for (int run = 0; run < 3; run++) {
+        auto start = std::chrono::steady_clock::now();
+        ctx.majorGC();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        best_ms = std::min(best_ms, elapsed.count());
+    }
+    return best_ms;
+}
+
+/// usage: tlc_bench [n_live_arrays] [max_threads]
+int main(int argc, char** argv) {
+    i64 n_arrays = argc > 1 ? std::atoll(argv[1]) : 2000000;
+    i64 max_threads = argc > 2 ? std::atoll(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+
+    Context ctx;
+    buildTree(ctx, n_arrays, 4);
+
+    std::cout << "majorGC pause with " << n_arrays << " live arrays\n";
+    std::cout << "sequential\tpause: " << measurePause(ctx, 0) << " ms\n";
+    // speedups are relative to the work-stealing marker with a single worker, not to the sequential marker
+    double single_thread_ms = 0;
+    for (i64 n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        double best_ms = measurePause(ctx, n_threads);
+        if (n_threads == 1)
+            single_thread_ms = best_ms;
+        std::cout << "threads: " << n_threads
+                  << "\tpause: " << best_ms << " ms"
+                  << "\tspeedup: " << single_thread_ms / best_ms << "x\n";
+        if (n_threads < max_threads && n_threads * 2 > max_threads)
+            n_threads = max_threads / 2;
+    }
+    return 0;
+}
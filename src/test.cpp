@@ -1,6 +1,7 @@
 #include <iostream>
 #include <string>
 #include <functional>
+#include <vector>
 #include "tlc/rt.h"
 
 bool all_tests_passed = true;
@@ -23,6 +24,18 @@ int main() {
 
     Context ctx;
 
+    // runs a test against both reference counting policies, no matter which policy Context is built with
+    auto runCountingTest = [&](const std::string& testName, auto test) {
+        runTest(testName + " - {'policy': 'RefCountingGC'}", [&]() {
+            BasicContext<RefCountingGC> local;
+            test(local);
+        });
+        runTest(testName + " - {'policy': 'DeferredRefCountingGC'}", [&]() {
+            BasicContext<DeferredRefCountingGC> local;
+            test(local);
+        });
+    };
+
     runTest("Basic Allocation", [&]() {
         Value handle = ctx.alloc(10);
         if (handle.type != ValueType::memory_handle) {
@@ -100,6 +113,37 @@ int main() {
         }
     });
 
+    runTest("Bitwise and Arithmetic Operators on Negative Integers", [&]() {
+        Value v1(-12, ValueType::integer);
+        Value v2(5, ValueType::integer);
+        if ((v1 + v2).data != -7 || (v1 - v2).data != -17 || (v1 & v2).data != 4
+            || (v1 | v2).data != -11 || (v1 ^ v2).data != -15 || (~v1).data != 11) {
+            throw std::runtime_error("Operators on negative integers failed");
+        }
+        if ((v1 + v2).type != ValueType::integer) {
+            throw std::runtime_error("Operator result is not an integer");
+        }
+    });
+
+#ifdef COMPACT_VALUES
+    runTest("Compact Value Size", [&]() {
+        if (sizeof(Value) != 8) {
+            throw std::runtime_error("Compact value is " + std::to_string(sizeof(Value)) + " bytes");
+        }
+    });
+#endif
+
+    runTest("Operators Reject Memory Handles", [&]() {
+        Value handle = ctx.alloc(1);
+        try {
+            handle + Value(1, ValueType::integer);
+        } catch (const std::runtime_error&) {
+            // Expected
+            return;
+        }
+        throw std::runtime_error("Adding to a memory handle did not throw");
+    });
+
     runTest("Invalid Memory Access", [&]() {
         try {
             Value invalidHandle(999, ValueType::memory_handle);
@@ -111,6 +155,218 @@ int main() {
         throw std::runtime_error("Invalid memory access did not throw");
     });
 
+    runTest("Forged Memory Handle Ids Are Rejected", [&]() {
+        Context local;
+        Value handle = local.alloc(1);
+        for (i64 forged : {handle.data + (i64(1) << 32), handle.data + 1, i64(-1), i64(0)}) {
+            try {
+                local.read(Value(forged, ValueType::memory_handle), 0);
+            } catch (const std::runtime_error&) {
+                continue;  // Expected
+            }
+            throw std::runtime_error("Forged handle id " + std::to_string(forged) + " was accepted");
+        }
+    });
+
+    runTest("Non-Throwing Operations Report Sticky Status", [&]() {
+        Context local;
+        Value array = local.alloc(2);
+        Status status = Status::ok;
+        Value sum = Value(40, ValueType::integer).add(Value(2, ValueType::integer), status);
+        local.write(array, 0, sum, status);
+        local.push(array, sum, status);
+        if (status != Status::ok || local.read(array, 0, status).data != 42 || local.pop(array, status).data != 42)
+            throw std::runtime_error("Valid operations failed");
+        local.read(array, 2, status);
+        array.add(sum, status);
+        local.read(Value(array.data + 1, ValueType::memory_handle), 0, status);
+        if (status != Status::invalid_index)
+            throw std::runtime_error(std::string("Expected the first error to stick, got: ") + statusMessage(status));
+        status = Status::ok;
+        local.pop(local.alloc(0), status);
+        if (status != Status::empty_pop)
+            throw std::runtime_error("Popping from an empty array was not reported");
+    });
+
+    // stored handles are only validated by the policies that count references
+    runCountingTest("Non-Throwing Writes Reject Invalid Handles", [](auto& local) {
+        Value array = local.alloc(2);
+        Status status = Status::ok;
+        local.write(array, 1, Value(array.data + 1, ValueType::memory_handle), status);
+        if (status != Status::invalid_handle || local.read(array, 1).data != 0)
+            throw std::runtime_error("Writing an invalid handle was not rejected without effect");
+    });
+
+    runTest("Unchecked Accesses On Valid Handles", [&]() {
+        Context local;
+        Value array = local.alloc(2);
+        Value child = local.alloc(1);
+        local.assign(1, array);
+        local.writeUnchecked(array, 0, child);
+        local.writeUnchecked(array, 1, Value(7, ValueType::integer));
+        local.pushUnchecked(array, Value(8, ValueType::integer));
+        if (local.readUnchecked(array, 0).data != child.data || local.readUnchecked(array, 1).data != 7
+            || local.popUnchecked(array).data != 8)
+            throw std::runtime_error("Unchecked accesses returned wrong values");
+        local.writeUnchecked(array, 0, Value(0, ValueType::integer));
+        local.minorGC();
+        local.majorGC();
+        try {
+            local.read(child, 0);
+        } catch (const std::runtime_error&) {
+            local.read(array, 0); // still referenced by variable 1
+            return;
+        }
+        throw std::runtime_error("Handle overwritten by an unchecked write was not released");
+    });
+
+    runTest("Payloads Of All Size Classes", [&]() {
+        Context local;
+        Value big = local.alloc(0);
+        local.assign(1, big);
+        for (i64 i = 0; i < 10000; i++)
+            local.push(big, Value(i, ValueType::integer));
+        std::vector<Value> arrays;
+        for (i64 size = 0; size < 100; size++) {
+            Value array = local.alloc(size * 7);
+            for (i64 i = 0; i < size * 7; i++)
+                local.write(array, i, Value(size, ValueType::integer));
+            arrays.push_back(array);
+        }
+        local.majorGC();
+        local.sweepGC();
+        for (i64 size = 0; size < 100; size++) {
+            Value array = local.alloc(size * 7);
+            for (i64 i = 0; i < size * 7; i++)
+                if (local.read(array, i).data != 0)
+                    throw std::runtime_error("Recycled payload is not zero-initialized");
+        }
+        for (i64 i = 9999; i >= 0; i--)
+            if (local.pop(big).data != i)
+                throw std::runtime_error("Grown payload lost its contents");
+    });
+
+    runTest("Oversized Allocations Are Rejected", [&]() {
+        Context local;
+        Value array = local.alloc(1);
+        try {
+            local.alloc(i64(1) << 60);
+        } catch (const std::runtime_error&) {
+            // Expected: the size in bytes would overflow
+            local.write(array, 0, Value(1, ValueType::integer));
+            local.majorGC();
+            return;
+        }
+        throw std::runtime_error("Allocation whose size overflows was accepted");
+    });
+
+    runTest("Small Arrays Keep Their Contents When Spilling", [&]() {
+        Context local;
+        Value tuple = local.alloc(4);
+        Value child = local.alloc(1);
+        local.assign(1, tuple);
+        for (i64 i = 0; i < 3; i++)
+            local.write(tuple, i, Value(i + 1, ValueType::integer));
+        local.write(tuple, 3, child);
+        local.push(tuple, Value(5, ValueType::integer));
+        for (i64 i = 0; i < 3; i++)
+            if (local.read(tuple, i).data != i + 1)
+                throw std::runtime_error("Inline entries were lost when spilling");
+        if (local.read(tuple, 3).data != child.data || local.read(tuple, 4).data != 5)
+            throw std::runtime_error("Entries were lost when spilling");
+        local.majorGC();
+        local.read(child, 0); // still referenced by the spilled payload
+    });
+
+    runTest("Compaction Keeps Payloads And Handles", [&]() {
+        Context local;
+        Value list = local.alloc(0);
+        Value unrooted = local.alloc(8);
+        local.assign(1, list);
+        local.write(unrooted, 7, Value(7, ValueType::integer));
+        for (i64 i = 0; i < 200; i++) {
+            Value element = local.alloc(8 + i % 24);
+            local.write(element, 0, Value(i, ValueType::integer));
+            if (i % 3 == 0)
+                local.push(list, element);
+        }
+        local.setCompactingGC(true);
+        local.majorGC();
+        local.compactGC();
+        for (i64 i = 0; i < 67; i++) {
+            Value element = local.read(list, i);
+            if (local.read(element, 0).data != 3 * i)
+                throw std::runtime_error("Payload was not preserved by compaction");
+        }
+        local.push(local.read(list, 0), Value(-1, ValueType::integer));
+        if (local.pop(local.read(list, 0)).data != -1)
+            throw std::runtime_error("Relocated payload cannot grow");
+        try {
+            local.read(unrooted, 7);
+        } catch (const std::runtime_error&) {
+            // Expected: compaction happens after the sweep
+            return;
+        }
+        throw std::runtime_error("Garbage survived a compacting major GC");
+    });
+
+    runTest("Grown Payloads Count As Allocations", [&]() {
+        Context local;
+        Value array = local.alloc(0);
+        local.assign(1, array);
+        std::size_t allocated = local.allocatedBytes(), live = local.liveBytes();
+        for (i64 i = 0; i < 1000; i++)
+            local.push(array, Value(i, ValueType::integer));
+        // every block the payload grew into was allocated, but only the last one is live
+        if (local.allocatedBytes() - allocated <= local.liveBytes() - live)
+            throw std::runtime_error("Growing a payload was not accounted as an allocation");
+    });
+
+    runTest("Heap Budget Triggers Major GC", [&]() {
+        Context local;
+        local.setHeapBudget(std::size_t(1) << 20);
+        Value kept = local.alloc(0);
+        local.assign(1, kept);
+        for (i64 i = 0; i < 20000; i++) {
+            // temporaries only referenced by the embedder survive until the next safepoint
+            Value array = local.alloc(64);
+            Value element = local.alloc(1);
+            local.write(array, 1, element);
+            local.write(array, 0, Value(i, ValueType::integer));
+            if (i % 100 == 0)
+                local.push(kept, array);
+            local.safepoint();
+        }
+        if (local.allocatedBytes() < 20000 * 64 * sizeof(Value))
+            throw std::runtime_error("Allocations were not accounted");
+        if (local.liveBytes() > (std::size_t(1) << 23))
+            throw std::runtime_error("Garbage was not collected automatically");
+        for (i64 i = 0; i < 200; i++)
+            if (local.read(local.read(kept, i), 0).data != 100 * i)
+                throw std::runtime_error("Automatic collection released a reachable array");
+        for (i64 i = 0; i < 200; i++)
+            local.read(local.read(local.read(kept, i), 1), 0);
+    });
+
+    runTest("Freed Handle Slots Are Recycled", [&]() {
+        Context local;
+        Value first = local.alloc(4);
+        local.majorGC();
+        Value second = local.alloc(2);
+        if ((first.data & 0xFFFFFFFF) != (second.data & 0xFFFFFFFF)) {
+            throw std::runtime_error("Freed slot was not reused");
+        }
+        try {
+            local.read(first, 0);
+        } catch (const std::runtime_error&) {
+            // Expected: the stale handle refers to an older generation of the slot
+            if (local.read(second, 1).data != 0)
+                throw std::runtime_error("Recycled handle is not zero-initialized");
+            return;
+        }
+        throw std::runtime_error("Stale handle to a recycled slot was accepted");
+    });
+
     runTest("Nested MemoryHandle with Multiple References", [&]() {
         // Allocate two memory handles
         Value outerHandle = ctx.alloc(2);
@@ -460,6 +716,568 @@ int main() {
             throw std::runtime_error("Cyclic references were not cleaned by major GC");
         });
 
+    for (int gc_cleanup_size : {-1, 7})
+        runTest(std::string("Major GC Traces Deep Structures - {'gc_cleanup_size': ")
+                + std::to_string(gc_cleanup_size)
+                + "}",
+                [&]() {
+            Context local;
+            Value head = local.alloc(2);
+            local.assign(1, head);
+            Value node = head;
+            for (int i = 0; i < 10000; i++) {
+                Value next = local.alloc(2);
+                local.write(node, 0, next);
+                local.write(node, 1, Value(i, ValueType::integer));
+                node = next;
+            }
+            Value garbage = local.alloc(1);
+
+            while (true) {
+                local.majorGC(gc_cleanup_size);
+                try {
+                    local.read(garbage, 0);
+                } catch (const std::runtime_error&) {
+                    break;  // cycle finished
+                }
+            }
+            if (local.read(node, 0).data != 0) {
+                throw std::runtime_error("Tail of reachable list was cleaned by major GC");
+            }
+
+            local.erase(1);
+            local.majorGC();
+            try {
+                local.read(node, 0);
+            } catch (const std::runtime_error&) {
+                // Expected behavior
+                return;
+            }
+            throw std::runtime_error("Unreachable list was not cleaned by major GC");
+        });
+
+    for (int n_threads : {1, 2, 4})
+        runTest(std::string("Parallel Major Garbage Collection - {'n_threads': ")
+                + std::to_string(n_threads)
+                + "}",
+                [&]() {
+            Context local;
+            local.setMajorGCThreads(n_threads);
+            std::vector<Value> reachable{local.alloc(3)};
+            local.assign(1, reachable[0]);
+            for (std::size_t i = 0; reachable.size() < 5000; i++) {
+                for (i64 j = 0; j < 3; j++) {
+                    Value child = local.alloc(3);
+                    local.write(reachable[i], j, child);
+                    reachable.push_back(child);
+                }
+            }
+            // cycle back to the root from the last array
+            local.write(reachable.back(), 0, reachable[0]);
+            Value garbage = local.alloc(1);
+            local.write(garbage, 0, reachable[0]);
+
+            local.majorGC();
+            for (const Value& handle : reachable)
+                local.read(handle, 0);
+            try {
+                local.read(garbage, 0);
+            } catch (const std::runtime_error&) {
+                local.erase(1);
+                local.majorGC();
+                try {
+                    local.read(reachable[4999], 0);
+                } catch (const std::runtime_error&) {
+                    // Expected behavior
+                    return;
+                }
+                throw std::runtime_error("Unreachable structure was not cleaned by parallel major GC");
+            }
+            throw std::runtime_error("Garbage was not cleaned by parallel major GC");
+        });
+
+    runTest("Incremental Major GC Keeps Handles Moved Behind Its Wavefront", [&]() {
+        Context local;
+        Value root = local.alloc(2);
+        Value a = local.alloc(1);
+        Value hidden = local.alloc(1);
+        local.assign(1, root);
+        local.write(root, 0, a);
+        local.write(a, 0, hidden);
+
+        // scans root completely, a is marked but not scanned yet
+        local.majorGC(2);
+        // move the only reference to hidden into the already scanned root
+        local.write(root, 1, hidden);
+        local.write(a, 0, Value(0, ValueType::integer));
+        // also allocate an array during the cycle and only reference it from a variable
+        Value fresh = local.alloc(1);
+        local.assign(2, fresh);
+        for (int i = 0; i < 10; i++)
+            local.majorGC(2);
+
+        try {
+            local.read(hidden, 0);
+            local.read(fresh, 0);
+        } catch (const std::runtime_error&) {
+            throw std::runtime_error("Handle reachable through mutations during the cycle was cleaned");
+        }
+    });
+
+    runTest("Full Major GC Supersedes Incremental Cycle", [&]() {
+        Context local;
+        Value root = local.alloc(0);
+        local.assign(1, root);
+        for (int i = 0; i < 100; i++)
+            local.push(root, local.alloc(1));
+        Value garbage = local.alloc(1);
+
+        for (int cycle = 0; cycle < 3; cycle++) {
+            // abandon a partially marked cycle, then collect fully and incrementally
+            local.majorGC(10);
+            local.majorGC();
+            while (!local.majorGC(10));
+            for (int i = 0; i < 100; i++)
+                local.read(local.read(root, i), 0);
+        }
+        try {
+            local.read(garbage, 0);
+        } catch (const std::runtime_error&) {
+            // Expected behavior
+            return;
+        }
+        throw std::runtime_error("Garbage survived full and incremental cycles");
+    });
+
+    runTest("Time-Budgeted Major GC Slices", [&]() {
+        Context local;
+        Value root = local.alloc(0);
+        local.assign(1, root);
+        for (int i = 0; i < 10000; i++) {
+            local.push(root, local.alloc(1));
+            local.alloc(1);  // garbage
+        }
+        Value garbage = local.alloc(1);
+
+        // an empty budget still makes progress, but splits the cycle into many slices
+        int n_slices = 1;
+        while (!local.majorGC(std::chrono::nanoseconds(0))) {
+            // keep mutating between slices
+            local.write(root, n_slices % 10000, local.alloc(1));
+            n_slices++;
+        }
+        if (n_slices < 10) {
+            throw std::runtime_error("Cycle finished in only " + std::to_string(n_slices) + " slices");
+        }
+        for (int i = 0; i < 10000; i++)
+            local.read(local.read(root, i), 0);
+        try {
+            local.read(garbage, 0);
+        } catch (const std::runtime_error&) {
+            if (!local.majorGC(std::chrono::seconds(10)))
+                throw std::runtime_error("Cycle did not finish within a generous budget");
+            return;
+        }
+        throw std::runtime_error("Garbage was not cleaned by time-budgeted major GC");
+    });
+
+    runTest("Lazy Sweeping After Major GC", [&]() {
+        Context local;
+        Value root = local.alloc(1);
+        local.assign(1, root);
+        std::vector<Value> garbage;
+        for (int i = 0; i < 100; i++)
+            garbage.push_back(local.alloc(1));
+        local.write(garbage[0], 0, root);
+
+        local.majorGC();
+        // garbage is dead immediately, even though it has not been released yet
+        for (const Value& handle : garbage) {
+            try {
+                local.read(handle, 0);
+            } catch (const std::runtime_error&) {
+                continue;  // Expected
+            }
+            throw std::runtime_error("Unswept garbage handle is still accessible");
+        }
+        if (local.sweepGC(10)) {
+            throw std::runtime_error("Sweeping 10 of 101 slots finished the sweep");
+        }
+        // alloc reclaims swept or garbage slots instead of growing the handle table
+        for (int i = 0; i < 100; i++) {
+            Value handle = local.alloc(1);
+            if ((handle.data & 0xFFFFFFFF) > 100) {
+                throw std::runtime_error("alloc grew the handle table despite unswept garbage");
+            }
+        }
+        local.read(root, 0);
+        if (!local.sweepGC()) {
+            throw std::runtime_error("Unbounded sweep did not finish");
+        }
+    });
+
+    runTest("Major GC Slices Bound The Sweep", [&]() {
+        Context local;
+        for (int i = 0; i < 1000; i++)
+            local.alloc(1);
+        local.majorGC();
+        // a step pays for 64 slots, so 2 steps cannot sweep 1000 slots, let alone start the next cycle
+        if (local.majorGC(2) || local.sweepGC(0)) {
+            throw std::runtime_error("Slice swept more slots than its budget allows");
+        }
+        // the next cycle only begins once the sweep is done
+        while (!local.majorGC(2)) {}
+    });
+
+    runTest("Major GC Slices Bound The Root Scan", [&]() {
+        Context local;
+        Value array = local.alloc(1);
+        for (VarT id = 0; id < 10000; id++)
+            local.assign(id, array);
+        local.majorGC();
+        local.sweepGC();
+        // a step pays for 64 buckets of variables, so a single step cannot shade 10000 of them
+        if (local.majorGC(1)) {
+            throw std::runtime_error("Slice shaded more variables than its budget allows");
+        }
+        while (!local.majorGC(1)) {}
+        local.read(array, 0);
+    });
+
+    runTest("GC Policies Can Be Mixed In One Process", [&]() {
+        BasicContext<TracingGC> tracing;
+        BasicContext<RefCountingGC> counting;
+        Value traced = tracing.alloc(1);
+        Value counted = counting.alloc(1);
+        tracing.assign(1, traced);
+        counting.assign(1, counted);
+        tracing.erase(1);
+        counting.erase(1);
+        tracing.minorGC();
+        counting.minorGC();
+        tracing.read(traced, 0); // minorGC does nothing without reference counting
+        try {
+            counting.read(counted, 0);
+        } catch (const std::runtime_error&) {
+            tracing.majorGC();
+            try {
+                tracing.read(traced, 0);
+            } catch (const std::runtime_error&) {
+                // Expected behavior
+                return;
+            }
+            throw std::runtime_error("Tracing-only context did not release garbage in majorGC");
+        }
+        throw std::runtime_error("Reference counting context did not release garbage in minorGC");
+    });
+
+    runCountingTest("Minor GC Releases Whole Dead Structures", [](auto& local) {
+        Value shared = local.alloc(1);
+        local.assign(2, shared);
+        Value head = local.alloc(2);
+        local.assign(1, head);
+        Value node = head;
+        for (int i = 0; i < 1000; i++) {
+            Value next = local.alloc(2);
+            local.write(node, 0, next);
+            local.write(node, 1, shared);
+            node = next;
+        }
+        local.erase(1);
+        local.minorGC();
+        try {
+            local.read(node, 0);
+        } catch (const std::runtime_error&) {
+            if (local.read(shared, 0).data != 0)
+                throw std::runtime_error("Shared handle was corrupted");
+            local.erase(2);
+            local.minorGC();
+            try {
+                local.read(shared, 0);
+            } catch (const std::runtime_error&) {
+                // Expected behavior
+                return;
+            }
+            throw std::runtime_error("Shared handle was not cleaned by minor GC");
+        }
+        throw std::runtime_error("Tail of dead list was not cleaned by a single minor GC");
+    });
+
+    runCountingTest("Minor GC With Step And Time Budgets", [](auto& local) {
+        Value head = local.alloc(1);
+        local.assign(1, head);
+        Value node = head;
+        for (int i = 0; i < 100; i++) {
+            Value next = local.alloc(1);
+            local.write(node, 0, next);
+            node = next;
+        }
+        local.erase(1);
+        if (local.minorGC(10))
+            throw std::runtime_error("Minor GC claimed to finish within too small a budget");
+        local.read(node, 0); // the tail must still be alive
+        try {
+            local.read(head, 0);
+        } catch (const std::runtime_error&) {
+            if (!local.minorGC(std::chrono::seconds(10)))
+                throw std::runtime_error("Minor GC did not finish within a generous time budget");
+            try {
+                local.read(node, 0);
+            } catch (const std::runtime_error&) {
+                // Expected behavior
+                return;
+            }
+            throw std::runtime_error("Remaining garbage was not released by a later minor GC");
+        }
+        throw std::runtime_error("Budgeted minor GC released nothing");
+    });
+
+    runCountingTest("Minor GC Candidates Are Queued Once", [](auto& local) {
+        Value array = local.alloc(1);
+        local.assign(1, array);
+        Value handle = local.alloc(1);
+        for (int i = 0; i < 1000; i++) {
+            local.write(array, 0, handle);
+            local.write(array, 0, Value(0, ValueType::integer));
+        }
+        local.write(array, 0, handle);
+        // a single queued entry is processed before the clock is first checked, 1000 duplicates would not be
+        if (!local.minorGC(std::chrono::nanoseconds(0)))
+            throw std::runtime_error("Handle was queued more than once");
+        local.read(handle, 0); // referenced again, so it must survive
+        local.erase(1);
+        local.minorGC();
+        try {
+            local.read(handle, 0);
+        } catch (const std::runtime_error&) {
+            // Expected behavior
+            return;
+        }
+        throw std::runtime_error("Handle was not requeued after its count dropped to zero again");
+    });
+    runCountingTest("Cycle Collection By Trial Deletion", [](auto& local) {
+        Value a = local.alloc(2), b = local.alloc(1);
+        Value c = local.alloc(1), d = local.alloc(1);
+        Value survivor = local.alloc(1);
+        local.write(a, 0, b);
+        local.write(b, 0, a);
+        local.write(a, 1, survivor);
+        local.write(c, 0, d);
+        local.write(d, 0, c);
+        local.assign(1, a);
+        local.assign(2, c);
+        local.assign(3, survivor);
+        local.erase(1);
+        local.erase(2);
+        local.assign(4, d); // keeps the second cycle alive
+        local.minorGC();
+        local.collectCycles();
+        try {
+            local.read(b, 0);
+        } catch (const std::runtime_error&) {
+            local.read(c, 0); // externally referenced cycle must survive
+            local.read(d, 0);
+            // the released cycle no longer counts as a reference to the survivor
+            local.erase(3);
+            local.minorGC();
+            try {
+                local.read(survivor, 0);
+            } catch (const std::runtime_error&) {
+                // Expected behavior
+                return;
+            }
+            throw std::runtime_error("Reference count of a handle referenced by a garbage cycle was not updated");
+        }
+        throw std::runtime_error("Garbage cycle was not collected");
+    });
+    runCountingTest("Variable Erased And Assigned Again Between Collections", [](auto& local) {
+        Value array = local.alloc(1);
+        local.assign(1, array);
+        local.minorGC();
+        local.erase(1);
+        local.assign(1, array);
+        local.assign(2, array);
+        local.minorGC();
+        local.read(array, 0); // still referenced by both variables
+        local.erase(1);
+        local.erase(2);
+        local.minorGC();
+        try {
+            local.read(array, 0);
+        } catch (const std::runtime_error&) {
+            // Expected behavior
+            return;
+        }
+        throw std::runtime_error("Variable references were counted more than once");
+    });
+    runCountingTest("Cycle Roots Are Pruned Without Collecting Cycles", [](auto& local) {
+        Value a = local.alloc(1), b = local.alloc(1);
+        local.write(a, 0, b);
+        local.write(b, 0, a);
+        local.assign(1, a);
+        local.erase(1);
+        local.minorGC(); // a is buffered as a possible cycle root
+        // handles that lose a reference and are released later leave stale roots behind
+        for (int i = 0; i < 10000; i++) {
+            Value child = local.alloc(0);
+            Value x = local.alloc(1), y = local.alloc(1);
+            local.assign(2, x);
+            local.assign(3, y);
+            local.write(x, 0, child);
+            local.write(y, 0, child);
+            local.write(x, 0, Value(0, ValueType::integer));
+            local.minorGC();
+        }
+        local.collectCycles();
+        try {
+            local.read(a, 0);
+        } catch (const std::runtime_error&) {
+            // Expected behavior
+            return;
+        }
+        throw std::runtime_error("Garbage cycle was not collected after its root survived pruning");
+    });
+    runCountingTest("Variable Reassignment Keeps Cycles Alive Until Erased", [](auto& local) {
+        Value a = local.alloc(1), b = local.alloc(1);
+        local.write(a, 0, b);
+        local.write(b, 0, a);
+        for (int i = 0; i < 100; i++) {
+            local.assign(1, a);
+            local.assign(1, b);
+        }
+        local.minorGC();
+        local.collectCycles();
+        local.read(a, 0); // referenced through variable 1
+        local.erase(1);
+        local.collectCycles();
+        try {
+            local.read(a, 0);
+        } catch (const std::runtime_error&) {
+            // Expected behavior
+            return;
+        }
+        throw std::runtime_error("Cycle was not collected after its variable was erased");
+    });
+
+    runTest("Generational Young Garbage Collection", [&]() {
+        Context local;
+        local.setGenerationalGC(true);
+        Value old_root = local.alloc(2);
+        Value old_garbage = local.alloc(1);
+        local.assign(1, old_root);
+        local.assign(3, old_garbage);
+        local.youngGC();  // promotes old_root and old_garbage
+        local.erase(3);
+
+        Value young_kept_by_old = local.alloc(1);
+        Value young_kept_by_young = local.alloc(1);
+        Value young_kept_by_var = local.alloc(1);
+        Value young_garbage = local.alloc(1);
+        local.write(old_root, 0, young_kept_by_old);
+        local.write(young_kept_by_old, 0, young_kept_by_young);
+        local.assign(2, young_kept_by_var);
+        local.write(young_garbage, 0, old_root);
+        local.youngGC();
+
+        local.read(young_kept_by_old, 0);
+        local.read(young_kept_by_young, 0);
+        local.read(young_kept_by_var, 0);
+        // old garbage is left to the major GC
+        local.read(old_garbage, 0);
+        try {
+            local.read(young_garbage, 0);
+        } catch (const std::runtime_error&) {
+            // the promoted handle is old now, so only a major GC may release it
+            local.write(old_root, 0, Value(0, ValueType::integer));
+            local.youngGC();
+            local.read(young_kept_by_old, 0);
+            local.majorGC();
+            try {
+                local.read(old_garbage, 0);
+            } catch (const std::runtime_error&) {
+                // Expected behavior
+                return;
+            }
+            throw std::runtime_error("Old garbage was not cleaned by major GC");
+        }
+        throw std::runtime_error("Young garbage was not cleaned by young GC");
+    });
+
+    runTest("Promoted Payloads Are Evacuated From The Nursery", [&]() {
+        Context local;
+        local.setGenerationalGC(true);
+        Value survivor = local.alloc(64);
+        Value spilled = local.alloc(2);
+        local.assign(1, survivor);
+        local.assign(2, spilled);
+        for (i64 i = 0; i < 64; i++)
+            local.write(survivor, i, Value(i, ValueType::integer));
+        for (i64 i = 0; i < 30; i++)
+            local.push(spilled, Value(i, ValueType::integer));
+        for (i64 i = 0; i < 16; i++)
+            local.alloc(64); // young garbage
+        local.youngGC();
+
+        // new young payloads reuse the nursery the survivors were moved out of
+        for (i64 i = 0; i < 16; i++) {
+            Value young = local.alloc(64);
+            for (i64 j = 0; j < 64; j++)
+                local.write(young, j, Value(-1, ValueType::integer));
+        }
+        for (i64 i = 0; i < 64; i++)
+            if (local.read(survivor, i).data != i)
+                throw std::runtime_error("Promoted payload was overwritten");
+        for (i64 i = 0; i < 30; i++)
+            if (local.read(spilled, i + 2).data != i)
+                throw std::runtime_error("Promoted spilled payload was overwritten");
+        local.push(spilled, Value(30, ValueType::integer));
+        local.setGenerationalGC(false);
+        if (local.pop(spilled).data != 30)
+            throw std::runtime_error("Payload grown after promotion was lost");
+    });
+
+    runTest("Concurrent Major Garbage Collection with Mutations", [&]() {
+        Context local;
+        Value root = local.alloc(0);
+        local.assign(1, root);
+        for (int i = 0; i < 20000; i++) {
+            Value node = local.alloc(1);
+            local.push(root, node);
+        }
+        Value hidden = local.alloc(1);
+        local.write(local.read(root, 0), 0, hidden);
+        Value garbage = local.alloc(1);
+
+        local.startConcurrentMajorGC();
+        // move the only reference to hidden into an array allocated during the cycle and out of its old place
+        Value fresh = local.alloc(1);
+        local.write(fresh, 0, hidden);
+        local.push(root, fresh);
+        local.write(local.read(root, 0), 0, Value(0, ValueType::integer));
+        // keep mutating while the marker thread runs
+        for (int i = 0; i < 20000; i++) {
+            Value node = local.alloc(1);
+            local.write(root, i, node);
+            local.write(node, 0, Value(i, ValueType::integer));
+        }
+        local.finishConcurrentMajorGC();
+
+        local.read(hidden, 0);
+        local.read(fresh, 0);
+        for (int i = 0; i < 20000; i++) {
+            if (local.read(local.read(root, i), 0).data != i) {
+                throw std::runtime_error("Array written during the concurrent cycle was corrupted");
+            }
+        }
+        try {
+            local.read(garbage, 0);
+        } catch (const std::runtime_error&) {
+            // Expected behavior
+            return;
+        }
+        throw std::runtime_error("Garbage was not cleaned by concurrent major GC");
+    });
+
     std::cout << (all_tests_passed ? "All tests passed!" : "Some tests failed!") << "\n";
     return 0;
 }